@@ -2,7 +2,36 @@
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // This is the list of token types the lexer can find. I chose enum class so names do not collide.
 // Each type tells how to handle the slice of code later in the parser.
@@ -10,46 +39,1659 @@
 enum class TokenType {
     Keyword, Identifier, Number,
     Operator, String, Comment, Punctuation,
+    Template, RegExp,
     EndOfFile
 };
 
+// Operator and Punctuation tokens also say which operator or punctuator they are, so a
+// parser can switch on a small number instead of comparing lexeme strings.
+// None (0) is used for all other token types. New values are only added at the end,
+// the numbers are stored in binary token files.
+enum class Op : uint8_t {
+    None,
+    Assign, Eq, StrictEq,               // =  ==  ===
+    Not, NotEq, StrictNotEq,            // !  !=  !==
+    Lt, LtEq, Shl,                      // <  <=  <<
+    Gt, GtEq, Shr, ShrAssign,           // >  >=  >>  >>=
+    UShr, UShrAssign,                   // >>>  >>>=
+    BitAnd, And, BitOr, Or,             // &  &&  |  ||
+    Add, Sub, Mul, Div, Mod, BitXor,    // +  -  *  /  %  ^
+    Inc, Dec, Exp,                      // ++  --  **
+    AddAssign, SubAssign, MulAssign,    // +=  -=  *=
+    DivAssign, ModAssign, ExpAssign,    // /=  %=  **=
+    ShlAssign, BitAndAssign,            // <<=  &=
+    BitOrAssign, BitXorAssign,          // |=  ^=
+    AndAssign, OrAssign,                // &&=  ||=
+    Nullish, NullishAssign,             // ??  and ?? followed by =
+    BitNot, Question,                   // ~  ?
+    Count
+};
+
+enum class Punc : uint8_t {
+    None,
+    LParen, RParen, LBrace, RBrace, LBracket, RBracket,   // ( ) { } [ ]
+    Comma, Semicolon, Dot,                                // , ; .
+    Ellipsis, OptionalChain, Colon, Arrow,                // ... ?. : =>
+    Count
+};
+
+// The text of every Op and Punc, in enum order.
+constexpr std::string_view opSpellings[] = {
+    "", "=", "==", "===", "!", "!=", "!==", "<", "<=", "<<", ">", ">=", ">>", ">>=",
+    ">>>", ">>>=", "&", "&&", "|", "||", "+", "-", "*", "/", "%", "^",
+    "++", "--", "**", "+=", "-=", "*=", "/=", "%=", "**=", "<<=", "&=", "|=", "^=",
+    "&&=", "||=", "??", "?\?=", "~", "?"     // "?\?=" is "??=", written so it is not a trigraph
+};
+constexpr std::string_view puncSpellings[] = {
+    "", "(", ")", "{", "}", "[", "]", ",", ";", ".", "...", "?.", ":", "=>"
+};
+
+// A template literal is one Template token if it has no ${...}, otherwise it is cut at every
+// substitution: `a${x}b${y}c` is Head "`a${", x, Middle "}b${", y, Tail "}c`".
+enum class TemplatePart : uint8_t {
+    None, NoSubstitution, Head, Middle, Tail
+};
+
+// Flags of a RegExp token, as bits in Token::sub. There are exactly eight: "dgimsuyv".
+enum class RegExpFlag : uint8_t {
+    HasIndices = 1 << 0, Global = 1 << 1, IgnoreCase = 1 << 2, Multiline = 1 << 3,
+    DotAll = 1 << 4, Unicode = 1 << 5, Sticky = 1 << 6, UnicodeSets = 1 << 7
+};
+constexpr std::string_view regExpFlagLetters = "dgimsuyv";
+
+static_assert(std::size(opSpellings) == static_cast<size_t>(Op::Count), "opSpellings must match Op");
+static_assert(std::size(puncSpellings) == static_cast<size_t>(Punc::Count), "puncSpellings must match Punc");
+
+inline std::string_view spelling(Op op) { return opSpellings[static_cast<size_t>(op)]; }
+inline std::string_view spelling(Punc punc) { return puncSpellings[static_cast<size_t>(punc)]; }
+
+// PunctuatorTrie is a DFA for all operators and punctuators, built by the compiler from the
+// two spelling tables above, so a new entry in a table is all it takes to add one.
+// Characters that can appear in a punctuator get a small class number (0 = can not), and
+// next[node][class] is the node after that character (0 = no way on). A node where a
+// punctuator ends has its type and Op/Punc. The lexer walks the trie as far as it can
+// and takes the last node where something ended, that is the longest match.
+struct PunctuatorTrie {
+    static constexpr size_t maxNodes = 96, maxClasses = 32;
+    uint8_t charClass[256] = {};
+    uint8_t next[maxNodes][maxClasses] = {};
+    TokenType type[maxNodes] = {};
+    uint8_t sub[maxNodes] = {};
+    bool accept[maxNodes] = {};
+    size_t nodeCount = 1, classCount = 1;
+
+    constexpr PunctuatorTrie() {
+        for (size_t i = 1; i < std::size(opSpellings); ++i) add(opSpellings[i], TokenType::Operator, i);
+        for (size_t i = 1; i < std::size(puncSpellings); ++i) add(puncSpellings[i], TokenType::Punctuation, i);
+    }
+
+    constexpr void add(std::string_view text, TokenType t, size_t id) {
+        size_t node = 0;
+        for (char c : text) {
+            uint8_t& cls = charClass[static_cast<unsigned char>(c)];
+            if (cls == 0) cls = static_cast<uint8_t>(classCount++);
+            if (next[node][cls] == 0) next[node][cls] = static_cast<uint8_t>(nodeCount++);
+            node = next[node][cls];
+        }
+        accept[node] = true;
+        type[node] = t;
+        sub[node] = static_cast<uint8_t>(id);
+    }
+};
+
+constexpr PunctuatorTrie punctuatorTrie{};
+static_assert(punctuatorTrie.nodeCount <= PunctuatorTrie::maxNodes, "PunctuatorTrie::maxNodes is too small");
+static_assert(punctuatorTrie.classCount <= PunctuatorTrie::maxClasses, "PunctuatorTrie::maxClasses is too small");
+
+
+// Extra facts about a token, stored as bits in Token::flags. The lexer sets them while it
+// reads the token, so later stages do not have to look at the source bytes again.
+enum class TokenFlag : uint8_t {
+    HasEscape = 1 << 0,     // String, Template or Identifier with at least one backslash escape
+    NewlineBefore = 1 << 1, // a line break since the last token that is not a comment (for ASI)
+    IsInteger = 1 << 2,     // Number without '.' and exponent (also hex, octal, binary, BigInt)
+    IsBigInt = 1 << 3,      // Number with the 'n' suffix
+    HasSeparator = 1 << 4,  // Number with '_' separators
+    NonAscii = 1 << 5,      // lexeme has bytes >= 0x80
+};
 
 // The Token struct stores the token’s type, the lexeme) and its position (line and column).
 // I added line and column so it is easier to report errors with exact location.
 // This helps debugging code and printing error messages.
+// offset is the byte index of the first character in the input, so the lexeme is always
+// input.substr(offset, lexeme.size()). Tools that keep the source can use it instead of the text.
+// The lexeme is a view into the source and not a copy, so making a token never allocates.
+// This means tokens are valid only as long as the source string they came from.
+// symbol is the id of the name in a SymbolTable for Identifier and Keyword tokens when the
+// lexer has one (see BasicLexer::setSymbols), and 0 otherwise. String tokens get one too
+// if LexerConfig::internStrings is on.
+// sub is the Op of an Operator token or the Punc of a Punctuation token, use op() and punc().
+// flags has the TokenFlag bits of the token, use has().
 struct Token {
     TokenType type;
-    std::string lexeme;
+    std::string_view lexeme;
     int line, column;
+    size_t offset;
+    uint32_t symbol = 0;
+    uint8_t sub = 0;
+    uint8_t flags = 0;
+    // The bytes behind value() and decoded(). A token has at most one of them, so they share
+    // the place: a Number keeps the bits of its double here, a String or Identifier the
+    // pointer and the length of its decoded text.
+    uint64_t payload = 0;
+    uint32_t payloadSize = 0;
+
+    Op op() const { return type == TokenType::Operator ? static_cast<Op>(sub) : Op::None; }
+    Punc punc() const { return type == TokenType::Punctuation ? static_cast<Punc>(sub) : Punc::None; }
+    // Value of a Number token, set only if LexerConfig::parseNumbers is on. A BigInt gets the
+    // nearest double.
+    double value() const { return type == TokenType::Number ? std::bit_cast<double>(payload) : 0; }
+    // Value of a String token without quotes and with escapes decoded to UTF-8, set only if
+    // LexerConfig::decodeStrings is on. Without escapes it points into the source, otherwise
+    // into the lexer's StringArena. An Identifier with escapes (HasEscape) gets its name here.
+    std::string_view decoded() const {
+        if (type != TokenType::String && type != TokenType::Identifier) return {};
+        return { reinterpret_cast<const char*>(payload), payloadSize };
+    }
+    void setValue(double v) { payload = std::bit_cast<uint64_t>(v); }
+    void setDecoded(std::string_view text) {
+        payload = reinterpret_cast<uintptr_t>(text.data());
+        payloadSize = static_cast<uint32_t>(text.size());
+    }
+    TemplatePart templatePart() const {
+        return type == TokenType::Template ? static_cast<TemplatePart>(sub) : TemplatePart::None;
+    }
+    // For a RegExp token "/ab+c/gi": pattern() is "ab+c", has(RegExpFlag::Global) is true.
+    std::string_view pattern() const {
+        if (type != TokenType::RegExp) return {};
+        return lexeme.substr(1, lexeme.size() - 2 - std::popcount(sub));
+    }
+    bool has(RegExpFlag flag) const { return type == TokenType::RegExp && (sub & static_cast<uint8_t>(flag)); }
+    bool has(TokenFlag flag) const { return flags & static_cast<uint8_t>(flag); }
+    void set(TokenFlag flag) { flags |= static_cast<uint8_t>(flag); }
 };
 
-class Lexer {
-    std::string input;
-    size_t pos = 0;
-    int line = 1, col = 1;
-    std::unordered_set<std::string> keywords = {
+// Short names of token types for trace output, in the same order as TokenType.
+// I keep them in a table so printing a token does not need a switch or a new string each time.
+constexpr std::string_view tokenTags[] = { "KW", "ID", "NUM", "OP", "STR", "CMT", "PUN", "TPL", "RE", "EOF" };
+static_assert(std::size(tokenTags) == static_cast<size_t>(TokenType::EndOfFile) + 1, "tokenTags must match TokenType");
+
+inline std::string_view tokenTag(TokenType type) {
+    return tokenTags[static_cast<size_t>(type)];
+}
+
+// Token::column counts bytes. Other tools count columns in other units:
+// Utf16 - UTF-16 code units, what LSP clients want (a code point over U+FFFF is 2 units),
+// CodePoints - Unicode code points,
+// Display - code points, but a tab goes on to the next multiple of tabWidth (terminals).
+enum class ColumnUnit { Bytes, Utf16, CodePoints, Display };
+
+// Number of UTF-16 units (utf16) or code points in s[from, to), which must be whole code points.
+// A code point is one byte that is not a continuation byte (10xxxxxx), and a 4 byte one
+// (11110xxx) is 2 UTF-16 units. Both are counted 8 bytes at a time with popcount: the
+// shifts bring bit 6, 5 and 4 of every byte to the place of its bit 7.
+inline size_t countColumnUnits(std::string_view s, size_t from, size_t to, bool utf16) {
+    size_t units = 0;
+    constexpr uint64_t highBits = 0x8080808080808080ULL;
+    for (; from + 8 <= to; from += 8) {
+        uint64_t x;
+        std::memcpy(&x, s.data() + from, 8);
+        uint64_t continuation = x & ~(x << 1) & highBits;
+        units += 8 - std::popcount(continuation);
+        if (utf16) units += std::popcount(x & (x << 1) & (x << 2) & (x << 3) & highBits);
+    }
+    for (; from < to; ++from) {
+        unsigned char b = static_cast<unsigned char>(s[from]);
+        units += (b & 0xC0) != 0x80;
+        if (utf16) units += b >= 0xF0;
+    }
+    return units;
+}
+
+// ColumnMapper gives the column of tokens in another ColumnUnit. It is lazy: nothing is
+// computed before the first question and only the part of the line before the token is
+// counted. It remembers where it stopped, so for tokens asked in source order (the usual
+// case) every byte is counted only once, a whole file costs about one pass over it.
+// The start of the line comes from the token: offset - (column - 1).
+class ColumnMapper {
+    std::string_view source;
+    ColumnUnit unit;
+    int tabWidth;
+    // source[lineStart, at) is units columns wide
+    size_t lineStart = 0, at = 0;
+    size_t units = 0;
+
+public:
+    explicit ColumnMapper(std::string_view source, ColumnUnit unit = ColumnUnit::Utf16, int tabWidth = 8)
+        : source(source), unit(unit), tabWidth(tabWidth) {
+        if (tabWidth < 1) throw std::runtime_error("Tab width must be at least 1");
+    }
+
+    int column(const Token& t) { return column(t.offset, t.column); }
+
+    // 1-based column of the byte at offset, byteColumn is its column in bytes.
+    int column(size_t offset, int byteColumn) {
+        if (unit == ColumnUnit::Bytes) return byteColumn;
+        size_t start = offset - static_cast<size_t>(byteColumn - 1);
+        if (start != lineStart || offset < at) {
+            lineStart = at = start;
+            units = 0;
+        }
+        if (unit == ColumnUnit::Display) {
+            // Between tabs the code points are counted with SWAR.
+            while (at < offset) {
+                const void* tab = std::memchr(source.data() + at, '\t', offset - at);
+                size_t end = tab ? static_cast<size_t>(static_cast<const char*>(tab) - source.data()) : offset;
+                units += countColumnUnits(source, at, end, false);
+                at = end;
+                if (tab) {
+                    units = (units / tabWidth + 1) * tabWidth;
+                    ++at;
+                }
+            }
+        } else {
+            units += countColumnUnits(source, at, offset, unit == ColumnUnit::Utf16);
+            at = offset;
+        }
+        return static_cast<int>(units) + 1;
+    }
+};
+
+// TokenWriter is the output backend for token dumps. It formats each token as
+// [line:column] TYPE 'lexeme' straight into one big buffer (numbers with std::to_chars)
+// and gives the buffer to the OS with a few large write() calls instead of many small ones.
+// With background = true a second thread does the write() calls, so the lexer can
+// keep formatting into a fresh buffer while the previous one is written.
+class TokenWriter {
+    int fd;
+    bool background;
+    std::vector<char> buf;
+    size_t used = 0;
+
+    // State shared with the background thread. pending holds a full buffer waiting to be written.
+    std::thread worker;
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<char> pending;
+    size_t pendingSize = 0;
+    bool busy = false, stopping = false, failed = false;
+
+public:
+    explicit TokenWriter(int fd = 1, bool background = false, size_t capacity = 1 << 20)
+        : fd(fd), background(background), buf(capacity), pending(capacity) {
+        if (background) worker = std::thread([this] { run(); });
+    }
+
+    TokenWriter(const TokenWriter&) = delete;
+    TokenWriter& operator=(const TokenWriter&) = delete;
+
+    ~TokenWriter() {
+        try { flush(); } catch (...) {}
+        if (background) {
+            { std::lock_guard<std::mutex> lock(m); stopping = true; }
+            cv.notify_all();
+            worker.join();
+        }
+    }
+
+    void write(const Token& t) { write(t.type, t.line, t.column, t.lexeme); }
+
+    void write(TokenType type, int line, int column, std::string_view lexeme) {
+        std::string_view tag = tokenTag(type);
+        // 2 numbers of at most 11 chars each plus brackets, quotes and spaces.
+        char* out = reserve(lexeme.size() + tag.size() + 32);
+        *out++ = '[';
+        out = std::to_chars(out, out + 11, line).ptr;
+        *out++ = ':';
+        out = std::to_chars(out, out + 11, column).ptr;
+        *out++ = ']';
+        *out++ = ' ';
+        out = copy(out, tag);
+        *out++ = ' ';
+        *out++ = '\'';
+        out = copy(out, lexeme);
+        *out++ = '\'';
+        *out++ = '\n';
+        used = out - buf.data();
+    }
+
+    void write(std::string_view text) {
+        char* out = reserve(text.size());
+        used = copy(out, text) - buf.data();
+    }
+
+    // Sends everything formatted so far to the file and waits until it is written.
+    void flush() {
+        submit();
+        if (background) {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [this] { return !busy; });
+        }
+        if (failed) throw std::runtime_error("Failed to write token output");
+    }
+
+    // Low level access for other output formats (JSON): reserve() gives a place for n bytes
+    // in the buffer, the caller formats there and then calls commit() with the end pointer.
+    // If the buffer is full, it is handed off first.
+    // A single token bigger than the whole buffer (a huge comment) makes the buffer grow.
+    char* reserve(size_t n) {
+        if (used + n > buf.size()) {
+            submit();
+            if (n > buf.size()) buf.resize(n);
+        }
+        return buf.data() + used;
+    }
+
+    void commit(char* end) { used = end - buf.data(); }
+
+    static char* copy(char* out, std::string_view text) {
+        // An empty view can have a null data(), memcpy must not get it.
+        if (text.empty()) return out;
+        std::memcpy(out, text.data(), text.size());
+        return out + text.size();
+    }
+
+private:
+
+    void submit() {
+        if (used == 0) return;
+        if (!background) {
+            if (!writeAll(buf.data(), used)) failed = true;
+            used = 0;
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this] { return !busy; });
+        std::swap(buf, pending);
+        pendingSize = used;
+        busy = true;
+        lock.unlock();
+        cv.notify_all();
+        used = 0;
+        if (buf.size() < pending.size()) buf.resize(pending.size());
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [this] { return busy || stopping; });
+            if (!busy) return;
+            lock.unlock();
+            bool ok = writeAll(pending.data(), pendingSize);
+            lock.lock();
+            if (!ok) failed = true;
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+    // write() may write only part of the data, so I repeat it until everything is written.
+    bool writeAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+constexpr uint32_t invalidCodePoint = 0xFFFFFFFF;
+
+// Decodes the UTF-8 code point at s[p] and sets length to its number of bytes. Returns
+// invalidCodePoint (length 1) for a bad or overlong sequence, a surrogate or a cut one at the end.
+inline uint32_t decodeUtf8(std::string_view s, size_t p, size_t& length) {
+    length = 1;
+    unsigned char b0 = static_cast<unsigned char>(s[p]);
+    if (b0 < 0x80) return b0;
+    size_t n = b0 >= 0xF0 ? 4 : b0 >= 0xE0 ? 3 : b0 >= 0xC0 ? 2 : 0;
+    if (n == 0 || b0 > 0xF4 || p + n > s.size()) return invalidCodePoint;
+    uint32_t cp = b0 & (0x7F >> n);
+    for (size_t i = 1; i < n; ++i) {
+        unsigned char b = static_cast<unsigned char>(s[p + i]);
+        if ((b & 0xC0) != 0x80) return invalidCodePoint;
+        cp = (cp << 6) | (b & 0x3F);
+    }
+    static constexpr uint32_t smallest[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (cp < smallest[n] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return invalidCodePoint;
+    length = n;
+    return cp;
+}
+
+// For every byte: 0 if it can be copied as it is, otherwise the letter after '\' in its JSON
+// escape ('u' means \u00XX). Only control characters, '"' and '\' need escaping in JSON.
+struct JsonEscapeTable {
+    char esc[256] = {};
+    constexpr JsonEscapeTable() {
+        for (int c = 0; c < 0x20; ++c) esc[c] = 'u';
+        esc['\b'] = 'b'; esc['\f'] = 'f'; esc['\n'] = 'n'; esc['\r'] = 'r'; esc['\t'] = 't';
+        esc['"'] = '"'; esc['\\'] = '\\';
+    }
+};
+constexpr JsonEscapeTable jsonEscapes{};
+
+// JsonTokenWriter writes tokens as JSON through a TokenWriter buffer.
+// In NDJSON mode every token is one object on its own line. In file mode every file is
+// one object {"file":...,"tokens":[...]} on its own line.
+// A token object looks like {"type":"KW","line":1,"column":1,"offset":0,"lexeme":"let"}.
+// The input is expected to be UTF-8. Valid sequences are copied as they are, every byte that
+// is not part of one (Latin-1 text, a cut sequence) is written as \ufffd, so the output is
+// always valid JSON.
+class JsonTokenWriter {
+    TokenWriter& out;
+    bool ndjson;
+    bool firstToken = true;
+
+public:
+    explicit JsonTokenWriter(TokenWriter& out, bool ndjson = true) : out(out), ndjson(ndjson) {}
+
+    void beginFile(std::string_view name) {
+        if (ndjson) return;
+        out.write("{\"file\":");
+        writeString(name);
+        out.write(",\"tokens\":[");
+        firstToken = true;
+    }
+
+    // Closes the file object. If lexing failed, error holds the message and is added to the object.
+    // In NDJSON mode an error is written as its own line {"error":...}.
+    void endFile(std::string_view error = {}) {
+        if (ndjson) {
+            if (error.empty()) return;
+            out.write("{\"error\":");
+            writeString(error);
+            out.write("}\n");
+            return;
+        }
+        out.write("]");
+        if (!error.empty()) {
+            out.write(",\"error\":");
+            writeString(error);
+        }
+        out.write("}\n");
+    }
+
+    void write(const Token& t) { write(t.type, t.line, t.column, t.offset, t.lexeme); }
+
+    void write(TokenType type, int line, int column, size_t offset, std::string_view lexeme) {
+        char* p = out.reserve(128);
+        if (!ndjson && !firstToken) *p++ = ',';
+        firstToken = false;
+        p = TokenWriter::copy(p, "{\"type\":\"");
+        p = TokenWriter::copy(p, tokenTag(type));
+        p = TokenWriter::copy(p, "\",\"line\":");
+        p = std::to_chars(p, p + 11, line).ptr;
+        p = TokenWriter::copy(p, ",\"column\":");
+        p = std::to_chars(p, p + 11, column).ptr;
+        p = TokenWriter::copy(p, ",\"offset\":");
+        p = std::to_chars(p, p + 20, offset).ptr;
+        p = TokenWriter::copy(p, ",\"lexeme\":");
+        out.commit(p);
+        writeString(lexeme);
+        out.write(ndjson ? "}\n" : "}");
+    }
+
+    // Writes text as a quoted JSON string. Long runs of ASCII characters are found 8 bytes
+    // at a time and copied with memcpy, only the characters that need an escape and the
+    // bytes >= 0x80 (checked with decodeUtf8) go one by one.
+    // The text is handled in blocks so a huge comment never needs a huge buffer. A UTF-8
+    // sequence at the end of a block is read as a whole, the next block starts behind it.
+    void writeString(std::string_view text) {
+        constexpr size_t block = 1 << 16;
+        out.commit(TokenWriter::copy(out.reserve(1), "\""));
+        while (!text.empty()) {
+            size_t n = std::min(text.size(), block);
+            // Every byte can grow to at most 6 bytes (\u00XX, \ufffd), plus 3 bytes of a
+            // sequence that goes on behind the block.
+            char* p = out.reserve(n * 6 + 3);
+            size_t i = 0;
+            while (i < n) {
+                size_t run = i;
+                while (run + 8 <= n && !wordNeedsEscape(text.data() + run)) run += 8;
+                while (run < n && !jsonEscapes.esc[static_cast<unsigned char>(text[run])]
+                       && static_cast<unsigned char>(text[run]) < 0x80) ++run;
+                std::memcpy(p, text.data() + i, run - i);
+                p += run - i;
+                i = run;
+                if (run == n) break;
+                unsigned char c = static_cast<unsigned char>(text[run]);
+                if (c >= 0x80) {
+                    size_t length;
+                    if (decodeUtf8(text, run, length) == invalidCodePoint) {
+                        p = TokenWriter::copy(p, "\\ufffd");
+                    } else {
+                        std::memcpy(p, text.data() + run, length);
+                        p += length;
+                    }
+                    i = run + length;
+                    continue;
+                }
+                *p++ = '\\';
+                *p++ = jsonEscapes.esc[c];
+                if (jsonEscapes.esc[c] == 'u') {
+                    static constexpr char hex[] = "0123456789abcdef";
+                    *p++ = '0';
+                    *p++ = '0';
+                    *p++ = hex[c >> 4];
+                    *p++ = hex[c & 15];
+                }
+                i = run + 1;
+            }
+            out.commit(p);
+            text.remove_prefix(i);
+        }
+        out.commit(TokenWriter::copy(out.reserve(1), "\""));
+    }
+
+private:
+    // Checks 8 bytes at once (SWAR): true if any of them is below 0x20, '"', '\' or >= 0x80.
+    // hasZero(x) sets the high bit of every zero byte of x; bytes >= 0x80 never match it, they
+    // are found by their own high bit.
+    static bool wordNeedsEscape(const char* p) {
+        uint64_t x;
+        std::memcpy(&x, p, 8);
+        constexpr uint64_t ones = 0x0101010101010101ULL, high = 0x8080808080808080ULL;
+        auto hasZero = [&](uint64_t v) { return (v - ones) & ~v & high; };
+        uint64_t control = (x - ones * 0x20) & ~x & high;
+        return (control | hasZero(x ^ (ones * '"')) | hasZero(x ^ (ones * '\\')) | (x & high)) != 0;
+    }
+};
+
+// Observers are told about every token the lexer produces. The lexer takes the observer
+// as a template parameter, so the call is resolved at compile time and can be inlined.
+// NullObserver does nothing, so the normal lexer has no tracing code and no trace checks at all.
+// A custom observer only needs a method onToken(const Token&).
+struct NullObserver {
+    void onToken(const Token&) {}
+};
+
+// Sinks for BasicLexer::tokenize(Sink&). A sink has the same onToken method as an observer.
+// VectorSink appends all tokens to a vector, this is what tokenize() without arguments uses.
+struct VectorSink {
+    std::vector<Token>* tokens;
+    void onToken(const Token& t) { tokens->push_back(t); }
+};
+
+// CountingSink only counts tokens of each type.
+struct CountingSink {
+    size_t counts[static_cast<size_t>(TokenType::EndOfFile) + 1] = {};
+    size_t total = 0;
+    void onToken(const Token& t) {
+        ++counts[static_cast<size_t>(t.type)];
+        ++total;
+    }
+};
+
+// TokenChunks stores tokens in blocks of blockTokens tokens that are never moved, so unlike
+// std::vector there is no copy of all tokens when it grows and no 2x-3x memory peak, and a
+// reference to a token stays valid while more tokens are added (streaming consumers can keep
+// pointers). It is a sink itself. The result is used block by block (block(i)) or with
+// operator[] and iterators, it is never copied into one array.
+// clear() keeps the blocks, so a reused TokenChunks does not allocate again.
+class TokenChunks {
+public:
+    static constexpr size_t blockShift = 12;
+    static constexpr size_t blockTokens = size_t(1) << blockShift;
+
+private:
+    // Only the block pointers are in a vector, when it grows only they are moved.
+    std::vector<Token*> blocks;
+    size_t count = 0;
+
+public:
+    TokenChunks() = default;
+    TokenChunks(const TokenChunks&) = delete;
+    TokenChunks& operator=(const TokenChunks&) = delete;
+    TokenChunks(TokenChunks&& other) noexcept
+        : blocks(std::move(other.blocks)), count(std::exchange(other.count, 0)) {}
+    TokenChunks& operator=(TokenChunks&& other) noexcept {
+        std::swap(blocks, other.blocks);
+        std::swap(count, other.count);
+        return *this;
+    }
+    ~TokenChunks() {
+        for (Token* block : blocks) ::operator delete(block);
+    }
+
+    void onToken(const Token& t) { push_back(t); }
+
+    Token& push_back(const Token& t) {
+        size_t index = count & (blockTokens - 1);
+        size_t b = count >> blockShift;
+        // Token is trivially destructible, so a block is only raw memory until it is written.
+        if (b == blocks.size()) blocks.push_back(static_cast<Token*>(::operator new(blockTokens * sizeof(Token))));
+        Token* slot = std::construct_at(blocks[b] + index, t);
+        ++count;
+        return *slot;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear() { count = 0; }
+
+    const Token& operator[](size_t i) const { return blocks[i >> blockShift][i & (blockTokens - 1)]; }
+    Token& operator[](size_t i) { return blocks[i >> blockShift][i & (blockTokens - 1)]; }
+    const Token& back() const { return (*this)[count - 1]; }
+
+    // Number of blocks with tokens and the tokens of block b, all full except the last one.
+    size_t blockCount() const { return (count + blockTokens - 1) >> blockShift; }
+    std::span<const Token> block(size_t b) const {
+        return std::span<const Token>(blocks[b], std::min(blockTokens, count - (b << blockShift)));
+    }
+
+    class iterator {
+        const TokenChunks* chunks = nullptr;
+        size_t i = 0;
+
+    public:
+        using iterator_concept = std::forward_iterator_tag;
+        using value_type = Token;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        iterator(const TokenChunks* chunks, size_t i) : chunks(chunks), i(i) {}
+        const Token& operator*() const { return (*chunks)[i]; }
+        const Token* operator->() const { return &(*chunks)[i]; }
+        iterator& operator++() {
+            ++i;
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator old = *this;
+            ++i;
+            return old;
+        }
+        bool operator==(const iterator& other) const { return i == other.i; }
+    };
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, count); }
+};
+
+static_assert(std::is_trivially_destructible_v<Token>, "TokenChunks does not destroy tokens");
+static_assert(sizeof(Token) <= 64, "Token is copied for every token, keep it small");
+static_assert(std::ranges::forward_range<TokenChunks>, "TokenChunks must be a forward range");
+
+// TraceObserver prints each token as soon as it is read. This is what trace mode uses.
+// It only formats into the TokenWriter, the caller decides when to flush it.
+// With a ColumnMapper the columns are written in its unit instead of bytes.
+struct TraceObserver {
+    TokenWriter* out = nullptr;
+    ColumnMapper* columns = nullptr;
+    void onToken(const Token& t) {
+        if (columns) out->write(t.type, t.line, columns->column(t), t.lexeme);
+        else out->write(t);
+    }
+};
+
+// JsonObserver writes each token as JSON as soon as it is read.
+struct JsonObserver {
+    JsonTokenWriter* out = nullptr;
+    ColumnMapper* columns = nullptr;
+    void onToken(const Token& t) {
+        if (columns) out->write(t.type, t.line, columns->column(t), t.offset, t.lexeme);
+        else out->write(t);
+    }
+};
+
+template <typename LexerT>
+class TokenStream;
+
+// Character helpers for numbers. Unlike isdigit they take any char value, also negative ones.
+inline bool isDecimalDigit(char c) { return static_cast<unsigned char>(c - '0') < 10; }
+
+// Value of a digit in radix up to 16, or 99 if c is not a digit at all.
+inline int digitValue(char c) {
+    if (isDecimalDigit(c)) return c - '0';
+    char lower = static_cast<char>(c | 0x20);
+    if (lower >= 'a' && lower <= 'f') return lower - 'a' + 10;
+    return 99;
+}
+
+// Returns the end of the run of decimal digits that starts at p. Eight bytes are checked at
+// once (SWAR): a byte is a digit if its high nibble is 3 and its low nibble plus 6 does not
+// reach the high nibble. The first non-digit in a block is found with one countr_zero.
+// Only the last, shorter block is checked byte by byte.
+inline size_t skipDigits(std::string_view s, size_t p) {
+    if constexpr (std::endian::native == std::endian::little) {
+        constexpr uint64_t high = 0xF0F0F0F0F0F0F0F0ULL, low = 0x0F0F0F0F0F0F0F0FULL;
+        while (p + 8 <= s.size()) {
+            uint64_t x;
+            std::memcpy(&x, s.data() + p, 8);
+            // A byte of bad is 0 exactly when that byte is a digit.
+            uint64_t bad = ((x & high) ^ 0x3030303030303030ULL) | (((x & low) + 0x0606060606060606ULL) & high);
+            // Set the top bit of every byte of bad that is not 0.
+            uint64_t nonDigit = (bad | ((bad & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL)) & 0x8080808080808080ULL;
+            if (nonDigit) return p + (std::countr_zero(nonDigit) >> 3);
+            p += 8;
+        }
+    }
+    while (p < s.size() && isDecimalDigit(s[p])) ++p;
+    return p;
+}
+
+// True if s has a byte >= 0x80, 8 bytes are tested at once.
+inline bool hasNonAscii(std::string_view s) {
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= s.size(); i += 8) {
+        uint64_t x;
+        std::memcpy(&x, s.data() + i, 8);
+        bits |= x;
+    }
+    for (; i < s.size(); ++i) bits |= static_cast<unsigned char>(s[i]);
+    return bits & 0x8080808080808080ULL;
+}
+
+// Returns the position of the first quote, backslash, newline or extra at or after p inside a
+// string literal, or s.size(). Template literals pass '$' as extra. Same SWAR idea as skipDigits: a byte equal to c gives a zero byte in
+// x ^ (c * 0x01..01), and the classic (v - 0x01..) & ~v & 0x80.. test finds zero bytes.
+// Bytes after the first match can give false hits, but the first one is always right.
+inline size_t skipStringChars(std::string_view s, size_t p, char quote, char extra = '\n') {
+    if constexpr (std::endian::native == std::endian::little) {
+        constexpr uint64_t ones = 0x0101010101010101ULL, highBits = 0x8080808080808080ULL;
+        auto zeroBytes = [&](uint64_t v) { return (v - ones) & ~v & highBits; };
+        while (p + 8 <= s.size()) {
+            uint64_t x;
+            std::memcpy(&x, s.data() + p, 8);
+            uint64_t hit = zeroBytes(x ^ (ones * static_cast<unsigned char>(quote)))
+                | zeroBytes(x ^ (ones * '\\')) | zeroBytes(x ^ (ones * '\n'))
+                | zeroBytes(x ^ (ones * static_cast<unsigned char>(extra)));
+            if (hit) return p + (std::countr_zero(hit) >> 3);
+            p += 8;
+        }
+    }
+    while (p < s.size() && s[p] != quote && s[p] != '\\' && s[p] != '\n' && s[p] != extra) ++p;
+    return p;
+}
+
+// Exact powers of ten as double, 10^22 is the biggest one a double holds exactly.
+constexpr double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Value of hex/octal/binary digits (with '_' allowed) that do not fit in 64 bits, correctly
+// rounded. Hex goes to std::from_chars. For octal and binary I keep the first 64 significant
+// bits in m, and of all bits after them only how many there are (dropped) and if any of them
+// is 1 (sticky). Then m is rounded to 53 bits, half to even, like any double conversion.
+inline double parseWideRadixDigits(std::string_view text, int radix) {
+    if (radix == 16) {
+        std::string digits;
+        for (char c : text)
+            if (c != '_') digits += c;
+        double result;
+        auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), result,
+                                         std::chars_format::hex);
+        if (ec == std::errc::result_out_of_range) return std::numeric_limits<double>::infinity();
+        return result;
+    }
+    int bitsPerDigit = radix == 8 ? 3 : 1;
+    uint64_t m = 0;
+    int dropped = 0;
+    bool sticky = false;
+    for (char c : text) {
+        if (c == '_') continue;
+        int d = digitValue(c);
+        for (int b = bitsPerDigit - 1; b >= 0; b--) {
+            int bit = (d >> b) & 1;
+            if (m >> 63) {
+                sticky |= bit;
+                dropped++;
+            } else {
+                m = m << 1 | bit;
+            }
+        }
+    }
+    // m has its top bit set here, the caller only comes with more than 64 bits.
+    uint64_t mantissa = m >> 11, rest = m & 0x7FF;
+    if (rest > 0x400 || (rest == 0x400 && (sticky || (mantissa & 1)))) mantissa++;
+    return std::ldexp(static_cast<double>(mantissa), dropped + 11);
+}
+
+// Returns the value of a numeric literal that readNumberFA already checked, so no error
+// handling is needed here. It does not depend on the locale, unlike strtod.
+// Fast paths:
+//  - Integers (also hex/octal/binary and BigInt) are summed up in uint64_t, the only rounding is
+//    the last conversion to double, which is correct. Hex/octal/binary literals longer than
+//    64 bits go to parseWideRadixDigits, which rounds correctly too.
+//  - Decimals with at most 19 significant digits and a small exponent are done with one exact
+//    multiply or divide (Clinger's fast path): mantissa <= 2^53 and 10^|exp| <= 10^22 are both
+//    exact doubles, so the result is correctly rounded.
+// Everything else goes to std::from_chars, which rounds correctly (Eisel-Lemire in libstdc++).
+inline double parseNumber(std::string_view text) {
+    bool negative = false;
+    if (!text.empty() && (text[0] == '+' || text[0] == '-')) {
+        negative = text[0] == '-';
+        text.remove_prefix(1);
+    }
+    if (!text.empty() && text.back() == 'n') text.remove_suffix(1);
+
+    double result;
+    int radix = 10;
+    if (text.size() > 1 && text[0] == '0') {
+        char prefix = static_cast<char>(text[1] | 0x20);
+        if (prefix == 'x') radix = 16;
+        else if (prefix == 'o') radix = 8;
+        else if (prefix == 'b') radix = 2;
+    }
+    if (radix != 10) {
+        uint64_t n = 0;
+        bool overflow = false;
+        for (char c : text.substr(2)) {
+            if (c == '_') continue;
+            int d = digitValue(c);
+            if (n > (UINT64_MAX - d) / radix) {
+                overflow = true;
+                break;
+            }
+            n = n * radix + d;
+        }
+        result = overflow ? parseWideRadixDigits(text.substr(2), radix) : static_cast<double>(n);
+        return negative ? -result : result;
+    }
+
+    // Decimal: mantissa digits (without the '.'), their count and the decimal exponent.
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    size_t i = 0;
+    for (; i < text.size() && text[i] == '0'; i++) {}
+    bool fraction = false;
+    for (; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '_') continue;
+        if (c == '.') {
+            fraction = true;
+            continue;
+        }
+        if (!isDecimalDigit(c)) break;
+        if (digits == 0 && c == '0') {
+            // zeros right after the '.' (0.001) only move the exponent
+            if (fraction) exponent--;
+            continue;
+        }
+        if (++digits <= 19) mantissa = mantissa * 10 + (c - '0');
+        else if (!fraction) exponent++;
+        if (fraction && digits <= 19) exponent--;
+    }
+    if (i < text.size()) {
+        // 'e' or 'E', then the exponent with an optional sign
+        int e = 0;
+        bool negativeExp = false;
+        for (i++; i < text.size(); i++) {
+            char c = text[i];
+            if (c == '-') negativeExp = true;
+            else if (isDecimalDigit(c) && e < 100000) e = e * 10 + (c - '0');
+        }
+        exponent += negativeExp ? -e : e;
+    }
+
+    if (digits == 0) {
+        result = 0;
+    } else if (digits <= 19 && exponent == 0) {
+        result = static_cast<double>(mantissa);
+    } else if (digits <= 19 && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        result = exponent < 0 ? static_cast<double>(mantissa) / exactPowersOfTen[-exponent]
+                              : static_cast<double>(mantissa) * exactPowersOfTen[exponent];
+    } else {
+        // Slow path: from_chars does not know '_' and "1." / ".5" are fine for it.
+        std::string clean;
+        clean.reserve(text.size());
+        for (char c : text) {
+            if (c != '_') clean += c;
+        }
+        auto [end, ec] = std::from_chars(clean.data(), clean.data() + clean.size(), result);
+        if (ec == std::errc::result_out_of_range) {
+            // like JavaScript: too big is Infinity, too small is 0
+            result = exponent > 0 ? std::numeric_limits<double>::infinity() : 0.0;
+        }
+    }
+    return negative ? -result : result;
+}
+
+// Character classes of ASCII bytes, so the lexer does not need ctype: isalpha and friends
+// are undefined for negative chars (every byte of UTF-8 text >= 0x80) and depend on the locale.
+// Bytes from 0x80 have no class here, they are parts of UTF-8 code points.
+struct AsciiClassTable {
+    static constexpr uint8_t Space = 1, IdStart = 2, IdPart = 4;
+    uint8_t of[256] = {};
+    constexpr AsciiClassTable() {
+        for (int c = 'a'; c <= 'z'; ++c) of[c] = of[c - 32] = IdStart | IdPart;
+        for (int c = '0'; c <= '9'; ++c) of[c] = IdPart;
+        of['_'] = of['$'] = IdStart | IdPart;
+        of[' '] = of['\t'] = of['\n'] = of['\v'] = of['\f'] = of['\r'] = Space;
+    }
+    bool is(char c, uint8_t cls) const { return of[static_cast<unsigned char>(c)] & cls; }
+};
+constexpr AsciiClassTable asciiClass{};
+
+// Unicode ID_Start and the code points that are ID_Continue but not ID_Start, from 0x80 up
+// (Unicode 14). Each entry is a range: first code point << 11 | (length - 1), sorted, so one
+// binary search answers a lookup. Made with Python's unicodedata: ID_Start is categories
+// L* and Nl plus Other_ID_Start, ID_Continue adds Mn, Mc, Nd, Pc and Other_ID_Continue.
+constexpr uint32_t idStartRanges[] = {
+    0x00055000, 0x0005A800, 0x0005D000, 0x00060016, 0x0006C01E, 0x0007C1C9, 0x0016300B, 0x00170004,
+    0x00176000, 0x00177000, 0x001B8004, 0x001BB001, 0x001BD003, 0x001BF800, 0x001C3000, 0x001C4002,
+    0x001C6000, 0x001C7013, 0x001D1852, 0x001FB88A, 0x002450A5, 0x00298825, 0x002AC800, 0x002B0028,
+    0x002E801A, 0x002F7803, 0x0031002A, 0x00337001, 0x00338862, 0x0036A800, 0x00372801, 0x00377001,
+    0x0037D002, 0x0037F800, 0x00388000, 0x0038901D, 0x003A6858, 0x003D8800, 0x003E5020, 0x003FA001,
+    0x003FD000, 0x00400015, 0x0040D000, 0x00412000, 0x00414000, 0x00420018, 0x0043000A, 0x00438017,
+    0x00444805, 0x00450029, 0x00482035, 0x0049E800, 0x004A8000, 0x004AC009, 0x004B880F, 0x004C2807,
+    0x004C7801, 0x004C9815, 0x004D5006, 0x004D9000, 0x004DB003, 0x004DE800, 0x004E7000, 0x004EE001,
+    0x004EF802, 0x004F8001, 0x004FE000, 0x00502805, 0x00507801, 0x00509815, 0x00515006, 0x00519001,
+    0x0051A801, 0x0051C001, 0x0052C803, 0x0052F000, 0x00539002, 0x00542808, 0x00547802, 0x00549815,
+    0x00555006, 0x00559001, 0x0055A804, 0x0055E800, 0x00568000, 0x00570001, 0x0057C800, 0x00582807,
+    0x00587801, 0x00589815, 0x00595006, 0x00599001, 0x0059A804, 0x0059E800, 0x005AE001, 0x005AF802,
+    0x005B8800, 0x005C1800, 0x005C2805, 0x005C7002, 0x005C9003, 0x005CC801, 0x005CE000, 0x005CF001,
+    0x005D1801, 0x005D4002, 0x005D700B, 0x005E8000, 0x00602807, 0x00607002, 0x00609016, 0x0061500F,
+    0x0061E800, 0x0062C002, 0x0062E800, 0x00630001, 0x00640000, 0x00642807, 0x00647002, 0x00649016,
+    0x00655009, 0x0065A804, 0x0065E800, 0x0066E801, 0x00670001, 0x00678801, 0x00682008, 0x00687002,
+    0x00689028, 0x0069E800, 0x006A7000, 0x006AA002, 0x006AF802, 0x006BD005, 0x006C2811, 0x006CD017,
+    0x006D9808, 0x006DE800, 0x006E0006, 0x0070082F, 0x00719001, 0x00720006, 0x00740801, 0x00742000,
+    0x00743004, 0x00746017, 0x00752800, 0x00753809, 0x00759001, 0x0075E800, 0x00760004, 0x00763000,
+    0x0076E003, 0x00780000, 0x007A0007, 0x007A4823, 0x007C4004, 0x0080002A, 0x0081F800, 0x00828005,
+    0x0082D003, 0x00830800, 0x00832801, 0x00837002, 0x0083A80C, 0x00847000, 0x00850025, 0x00863800,
+    0x00866800, 0x0086802A, 0x0087E14C, 0x00925003, 0x00928006, 0x0092C000, 0x0092D003, 0x00930028,
+    0x00945003, 0x00948020, 0x00959003, 0x0095C006, 0x00960000, 0x00961003, 0x0096400E, 0x0096C038,
+    0x00989003, 0x0098C042, 0x009C000F, 0x009D0055, 0x009FC005, 0x00A00A6B, 0x00B37810, 0x00B40819,
+    0x00B5004A, 0x00B7700A, 0x00B80011, 0x00B8F812, 0x00BA0011, 0x00BB000C, 0x00BB7002, 0x00BC0033,
+    0x00BEB800, 0x00BEE000, 0x00C10058, 0x00C40028, 0x00C55000, 0x00C58045, 0x00C8001E, 0x00CA801D,
+    0x00CB8004, 0x00CC002B, 0x00CD8019, 0x00D00016, 0x00D10034, 0x00D53800, 0x00D8282E, 0x00DA2807,
+    0x00DC181D, 0x00DD7001, 0x00DDD02B, 0x00E00023, 0x00E26802, 0x00E2D023, 0x00E40008, 0x00E4802A,
+    0x00E5E802, 0x00E74803, 0x00E77005, 0x00E7A801, 0x00E7D000, 0x00E800BF, 0x00F00115, 0x00F8C005,
+    0x00F90025, 0x00FA4005, 0x00FA8007, 0x00FAC800, 0x00FAD800, 0x00FAE800, 0x00FAF81E, 0x00FC0034,
+    0x00FDB006, 0x00FDF000, 0x00FE1002, 0x00FE3006, 0x00FE8003, 0x00FEB005, 0x00FF000C, 0x00FF9002,
+    0x00FFB006, 0x01038800, 0x0103F800, 0x0104800C, 0x01081000, 0x01083800, 0x01085009, 0x0108A800,
+    0x0108C005, 0x01092000, 0x01093000, 0x01094000, 0x0109500F, 0x0109E003, 0x010A2804, 0x010A7000,
+    0x010B0028, 0x016000E4, 0x01675803, 0x01679001, 0x01680025, 0x01693800, 0x01696800, 0x01698037,
+    0x016B7800, 0x016C0016, 0x016D0006, 0x016D4006, 0x016D8006, 0x016DC006, 0x016E0006, 0x016E4006,
+    0x016E8006, 0x016EC006, 0x01802802, 0x01810808, 0x01818804, 0x0181C004, 0x01820855, 0x0184D804,
+    0x01850859, 0x0187E003, 0x0188282A, 0x0189885D, 0x018D001F, 0x018F800F, 0x01A007FF, 0x01E007FF,
+    0x022007FF, 0x026001BF, 0x027007FF, 0x02B007FF, 0x02F007FF, 0x033007FF, 0x037007FF, 0x03B007FF,
+    0x03F007FF, 0x043007FF, 0x047007FF, 0x04B007FF, 0x04F0068C, 0x0526802D, 0x0528010C, 0x0530800F,
+    0x05315001, 0x0532002E, 0x0533F81E, 0x0535004F, 0x0538B808, 0x05391066, 0x053C583F, 0x053E8001,
+    0x053E9800, 0x053EA804, 0x053F900F, 0x05401802, 0x05403803, 0x05406016, 0x05420033, 0x05441031,
+    0x05479005, 0x0547D800, 0x0547E801, 0x0548501B, 0x05498016, 0x054B001C, 0x054C202E, 0x054E7800,
+    0x054F0004, 0x054F3009, 0x054FD004, 0x05500028, 0x05520002, 0x05522007, 0x05530016, 0x0553D000,
+    0x0553F031, 0x05558800, 0x0555A801, 0x0555C804, 0x05560000, 0x05561000, 0x0556D802, 0x0557000A,
+    0x05579002, 0x05580805, 0x05584805, 0x05588805, 0x05590006, 0x05594006, 0x0559802A, 0x055AE00D,
+    0x055B8072, 0x056007FF, 0x05A007FF, 0x05E007FF, 0x062007FF, 0x066007FF, 0x06A003A3, 0x06BD8016,
+    0x06BE5830, 0x07C8016D, 0x07D38069, 0x07D80006, 0x07D89804, 0x07D8E800, 0x07D8F809, 0x07D9500C,
+    0x07D9C004, 0x07D9F000, 0x07DA0001, 0x07DA1801, 0x07DA306B, 0x07DE996A, 0x07EA803F, 0x07EC9035,
+    0x07EF800B, 0x07F38004, 0x07F3B086, 0x07F90819, 0x07FA0819, 0x07FB3058, 0x07FE1005, 0x07FE5005,
+    0x07FE9005, 0x07FED002, 0x0800000B, 0x08006819, 0x08014012, 0x0801E001, 0x0801F80E, 0x0802800D,
+    0x0804007A, 0x080A0034, 0x0814001C, 0x08150030, 0x0818001F, 0x0819681D, 0x081A8025, 0x081C001D,
+    0x081D0023, 0x081E4007, 0x081E8804, 0x0820009D, 0x08258023, 0x0826C023, 0x08280027, 0x08298033,
+    0x082B800A, 0x082BE00E, 0x082C6006, 0x082CA001, 0x082CB80A, 0x082D180E, 0x082D9806, 0x082DD801,
+    0x08300136, 0x083A0015, 0x083B0007, 0x083C0005, 0x083C3829, 0x083D9008, 0x08400005, 0x08404000,
+    0x0840502B, 0x0841B801, 0x0841E000, 0x0841F816, 0x08430016, 0x0844001E, 0x08470012, 0x0847A001,
+    0x08480015, 0x08490019, 0x084C0037, 0x084DF001, 0x08500000, 0x08508003, 0x0850A802, 0x0850C81C,
+    0x0853001C, 0x0854001C, 0x08560007, 0x0856481B, 0x08580035, 0x085A0015, 0x085B0012, 0x085C0011,
+    0x08600048, 0x08640032, 0x08660032, 0x08680023, 0x08740029, 0x08758001, 0x0878001C, 0x08793800,
+    0x08798015, 0x087B8011, 0x087D8014, 0x087F0016, 0x08801834, 0x08838801, 0x0883A800, 0x0884182C,
+    0x08868018, 0x08881823, 0x088A2000, 0x088A3800, 0x088A8022, 0x088BB000, 0x088C182F, 0x088E0803,
+    0x088ED000, 0x088EE000, 0x08900011, 0x08909818, 0x08940006, 0x08944000, 0x08945003, 0x0894780E,
+    0x0894F809, 0x0895802E, 0x08982807, 0x08987801, 0x08989815, 0x08995006, 0x08999001, 0x0899A804,
+    0x0899E800, 0x089A8000, 0x089AE804, 0x08A00034, 0x08A23803, 0x08A2F802, 0x08A4002F, 0x08A62001,
+    0x08A63800, 0x08AC002E, 0x08AEC003, 0x08B0002F, 0x08B22000, 0x08B4002A, 0x08B5C000, 0x08B8001A,
+    0x08BA0006, 0x08C0002B, 0x08C5003F, 0x08C7F807, 0x08C84800, 0x08C86007, 0x08C8A801, 0x08C8C017,
+    0x08C9F800, 0x08CA0800, 0x08CD0007, 0x08CD5026, 0x08CF0800, 0x08CF1800, 0x08D00000, 0x08D05827,
+    0x08D1D000, 0x08D28000, 0x08D2E02D, 0x08D4E800, 0x08D58048, 0x08E00008, 0x08E05024, 0x08E20000,
+    0x08E3901D, 0x08E80006, 0x08E84001, 0x08E85825, 0x08EA3000, 0x08EB0005, 0x08EB3801, 0x08EB501F,
+    0x08ECC000, 0x08F70012, 0x08FD8000, 0x09000399, 0x0920006E, 0x092400C3, 0x097C8060, 0x0980042E,
+    0x0A200246, 0x0B400238, 0x0B52001E, 0x0B53804E, 0x0B56801D, 0x0B58002F, 0x0B5A0003, 0x0B5B1814,
+    0x0B5BE812, 0x0B72003F, 0x0B78004A, 0x0B7A8000, 0x0B7C980C, 0x0B7F0001, 0x0B7F1800, 0x0B8007FF,
+    0x0BC007FF, 0x0C0007F7, 0x0C4004D5, 0x0C680008, 0x0D7F8003, 0x0D7FA806, 0x0D7FE801, 0x0D800122,
+    0x0D8A8002, 0x0D8B2003, 0x0D8B818B, 0x0DE0006A, 0x0DE3800C, 0x0DE40008, 0x0DE48009, 0x0EA00054,
+    0x0EA2B046, 0x0EA4F001, 0x0EA51000, 0x0EA52801, 0x0EA54803, 0x0EA5700B, 0x0EA5D800, 0x0EA5E806,
+    0x0EA62840, 0x0EA83803, 0x0EA86807, 0x0EA8B006, 0x0EA8F01B, 0x0EA9D803, 0x0EAA0004, 0x0EAA3000,
+    0x0EAA5006, 0x0EAA9153, 0x0EB54018, 0x0EB61018, 0x0EB6E01E, 0x0EB7E018, 0x0EB8B01E, 0x0EB9B018,
+    0x0EBA801E, 0x0EBB8018, 0x0EBC501E, 0x0EBD5018, 0x0EBE2007, 0x0EF8001E, 0x0F08002C, 0x0F09B806,
+    0x0F0A7000, 0x0F14801D, 0x0F16002B, 0x0F3F0006, 0x0F3F4003, 0x0F3F6801, 0x0F3F800E, 0x0F4000C4,
+    0x0F480043, 0x0F4A5800, 0x0F700003, 0x0F70281A, 0x0F710801, 0x0F712000, 0x0F713800, 0x0F714809,
+    0x0F71A003, 0x0F71C800, 0x0F71D800, 0x0F721000, 0x0F723800, 0x0F724800, 0x0F725800, 0x0F726802,
+    0x0F728801, 0x0F72A000, 0x0F72B800, 0x0F72C800, 0x0F72D800, 0x0F72E800, 0x0F72F800, 0x0F730801,
+    0x0F732000, 0x0F733803, 0x0F736006, 0x0F73A003, 0x0F73C803, 0x0F73F000, 0x0F740009, 0x0F745810,
+    0x0F750802, 0x0F752804, 0x0F755810, 0x100007FF, 0x104007FF, 0x108007FF, 0x10C007FF, 0x110007FF,
+    0x114007FF, 0x118007FF, 0x11C007FF, 0x120007FF, 0x124007FF, 0x128007FF, 0x12C007FF, 0x130007FF,
+    0x134007FF, 0x138007FF, 0x13C007FF, 0x140007FF, 0x144007FF, 0x148007FF, 0x14C007FF, 0x150006DF,
+    0x153807FF, 0x157807FF, 0x15B80038, 0x15BA00DD, 0x15C107FF, 0x160107FF, 0x16410681, 0x167587FF,
+    0x16B587FF, 0x16F587FF, 0x17358530, 0x17C0021D, 0x180007FF, 0x184007FF, 0x1880034A,
+};
+
+constexpr uint32_t idContinueRanges[] = {
+    0x0005B800, 0x0018006F, 0x001C3800, 0x00241804, 0x002C882C, 0x002DF800, 0x002E0801, 0x002E2001,
+    0x002E3800, 0x0030800A, 0x0032581E, 0x00338000, 0x0036B006, 0x0036F805, 0x00373801, 0x00375003,
+    0x00378009, 0x00388800, 0x0039801A, 0x003D300A, 0x003E0009, 0x003F5808, 0x003FE800, 0x0040B003,
+    0x0040D808, 0x00412802, 0x00414804, 0x0042C802, 0x0044C007, 0x00465017, 0x00471820, 0x0049D002,
+    0x0049F011, 0x004A8806, 0x004B1001, 0x004B3009, 0x004C0802, 0x004DE000, 0x004DF006, 0x004E3801,
+    0x004E5802, 0x004EB800, 0x004F1001, 0x004F3009, 0x004FF000, 0x00500802, 0x0051E000, 0x0051F004,
+    0x00523801, 0x00525802, 0x00528800, 0x0053300B, 0x0053A800, 0x00540802, 0x0055E000, 0x0055F007,
+    0x00563802, 0x00565802, 0x00571001, 0x00573009, 0x0057D005, 0x00580802, 0x0059E000, 0x0059F006,
+    0x005A3801, 0x005A5802, 0x005AA802, 0x005B1001, 0x005B3009, 0x005C1000, 0x005DF004, 0x005E3002,
+    0x005E5003, 0x005EB800, 0x005F3009, 0x00600004, 0x0061E000, 0x0061F006, 0x00623002, 0x00625003,
+    0x0062A801, 0x00631001, 0x00633009, 0x00640802, 0x0065E000, 0x0065F006, 0x00663002, 0x00665003,
+    0x0066A801, 0x00671001, 0x00673009, 0x00680003, 0x0069D801, 0x0069F006, 0x006A3002, 0x006A5003,
+    0x006AB800, 0x006B1001, 0x006B3009, 0x006C0802, 0x006E5000, 0x006E7805, 0x006EB000, 0x006EC007,
+    0x006F3009, 0x006F9001, 0x00718800, 0x0071A006, 0x00723807, 0x00728009, 0x00758800, 0x0075A008,
+    0x00764005, 0x00768009, 0x0078C001, 0x00790009, 0x0079A800, 0x0079B800, 0x0079C800, 0x0079F001,
+    0x007B8813, 0x007C3001, 0x007C680A, 0x007CC823, 0x007E3000, 0x00815813, 0x00820009, 0x0082B003,
+    0x0082F002, 0x00831002, 0x00833806, 0x00838803, 0x0084100B, 0x0084780E, 0x009AE802, 0x009B4808,
+    0x00B89003, 0x00B99002, 0x00BA9001, 0x00BB9001, 0x00BDA01F, 0x00BEE800, 0x00BF0009, 0x00C05802,
+    0x00C0780A, 0x00C54800, 0x00C9000B, 0x00C9800B, 0x00CA3009, 0x00CE800A, 0x00D0B804, 0x00D2A809,
+    0x00D3001C, 0x00D3F80A, 0x00D48009, 0x00D5800D, 0x00D5F80F, 0x00D80004, 0x00D9A010, 0x00DA8009,
+    0x00DB5808, 0x00DC0002, 0x00DD080C, 0x00DD8009, 0x00DF300D, 0x00E12013, 0x00E20009, 0x00E28009,
+    0x00E68002, 0x00E6A014, 0x00E76800, 0x00E7A000, 0x00E7B802, 0x00EE003F, 0x0101F801, 0x0102A000,
+    0x0106800C, 0x01070800, 0x0107280B, 0x01677802, 0x016BF800, 0x016F001F, 0x01815005, 0x0184C801,
+    0x05310009, 0x05337800, 0x0533A009, 0x0534F001, 0x05378001, 0x05401000, 0x05403000, 0x05405800,
+    0x05411804, 0x05416000, 0x05440001, 0x0545A011, 0x05468009, 0x05470011, 0x0547F80A, 0x05493007,
+    0x054A380C, 0x054C0003, 0x054D980D, 0x054E8009, 0x054F2800, 0x054F8009, 0x0551480D, 0x05521800,
+    0x05526001, 0x05528009, 0x0553D802, 0x05558000, 0x05559002, 0x0555B801, 0x0555F001, 0x05560800,
+    0x05575804, 0x0557A801, 0x055F1807, 0x055F6001, 0x055F8009, 0x07D8F000, 0x07F0000F, 0x07F1000F,
+    0x07F19801, 0x07F26802, 0x07F88009, 0x07F9F800, 0x080FE800, 0x08170000, 0x081BB004, 0x08250009,
+    0x08500802, 0x08502801, 0x08506003, 0x0851C002, 0x0851F800, 0x08572801, 0x08692003, 0x08698009,
+    0x08755801, 0x087A300A, 0x087C1003, 0x08800002, 0x0881C00E, 0x0883300A, 0x08839801, 0x0883F803,
+    0x0885800A, 0x08861000, 0x08878009, 0x08880002, 0x0889380D, 0x0889B009, 0x088A2801, 0x088B9800,
+    0x088C0002, 0x088D980D, 0x088E4803, 0x088E700B, 0x0891600B, 0x0891F000, 0x0896F80B, 0x08978009,
+    0x08980003, 0x0899D801, 0x0899F006, 0x089A3801, 0x089A5802, 0x089AB800, 0x089B1001, 0x089B3006,
+    0x089B8004, 0x08A1A811, 0x08A28009, 0x08A2F000, 0x08A58013, 0x08A68009, 0x08AD7806, 0x08ADC008,
+    0x08AEE001, 0x08B18010, 0x08B28009, 0x08B5580C, 0x08B60009, 0x08B8E80E, 0x08B98009, 0x08C1600E,
+    0x08C70009, 0x08C98005, 0x08C9B801, 0x08C9D803, 0x08CA0000, 0x08CA1001, 0x08CA8009, 0x08CE8806,
+    0x08CED006, 0x08CF2000, 0x08D00809, 0x08D19806, 0x08D1D803, 0x08D23800, 0x08D2880A, 0x08D4500F,
+    0x08E17807, 0x08E1C007, 0x08E28009, 0x08E49015, 0x08E5480D, 0x08E98805, 0x08E9D000, 0x08E9E001,
+    0x08E9F806, 0x08EA3800, 0x08EA8009, 0x08EC5004, 0x08EC8001, 0x08EC9804, 0x08ED0009, 0x08F79803,
+    0x0B530009, 0x0B560009, 0x0B578004, 0x0B598006, 0x0B5A8009, 0x0B7A7800, 0x0B7A8836, 0x0B7C7803,
+    0x0B7F2000, 0x0B7F8001, 0x0DE4E801, 0x0E78002D, 0x0E798016, 0x0E8B2804, 0x0E8B6805, 0x0E8BD807,
+    0x0E8C2806, 0x0E8D5003, 0x0E921002, 0x0EBE7031, 0x0ED00036, 0x0ED1D831, 0x0ED3A800, 0x0ED42000,
+    0x0ED4D804, 0x0ED5080E, 0x0F000006, 0x0F004010, 0x0F00D806, 0x0F011801, 0x0F013004, 0x0F098006,
+    0x0F0A0009, 0x0F157000, 0x0F17600D, 0x0F468006, 0x0F4A2006, 0x0F4A8009, 0x0FDF8009, 0x700800EF,
+};
+
+inline bool inRanges(const uint32_t* first, const uint32_t* last, uint32_t cp) {
+    const uint32_t* it = std::upper_bound(first, last, (cp << 11) | 0x7FF);
+    if (it == first) return false;
+    --it;
+    return cp - (*it >> 11) <= (*it & 0x7FF);
+}
+
+// ID_Start and ID_Continue like JavaScript wants them: '$' and '_' count, and ZWNJ and ZWJ
+// (U+200C, U+200D) can be inside a name.
+inline bool isIdStart(uint32_t cp) {
+    if (cp < 0x80) return asciiClass.is(static_cast<char>(cp), AsciiClassTable::IdStart);
+    return inRanges(std::begin(idStartRanges), std::end(idStartRanges), cp);
+}
+
+inline bool isIdContinue(uint32_t cp) {
+    if (cp < 0x80) return asciiClass.is(static_cast<char>(cp), AsciiClassTable::IdPart);
+    return cp == 0x200C || cp == 0x200D || isIdStart(cp)
+        || inRanges(std::begin(idContinueRanges), std::end(idContinueRanges), cp);
+}
+
+// Reads the rest of an escape "\uXXXX" or "\u{X...}" in s, i is right after the "\u" and is moved
+// behind the escape. Returns invalidCodePoint if it is malformed.
+inline uint32_t parseUnicodeEscape(std::string_view s, size_t& i) {
+    uint32_t cp = 0;
+    if (i < s.size() && s[i] == '{') {
+        size_t digits = 0;
+        for (++i; i < s.size() && s[i] != '}'; ++i, ++digits) {
+            int d = digitValue(s[i]);
+            if (d >= 16 || (cp = cp * 16 + d) > 0x10FFFF) return invalidCodePoint;
+        }
+        if (i == s.size() || digits == 0) return invalidCodePoint;
+        ++i;
+        return cp;
+    }
+    for (size_t k = 0; k < 4; ++k, ++i) {
+        int d = i < s.size() ? digitValue(s[i]) : 99;
+        if (d >= 16) return invalidCodePoint;
+        cp = cp * 16 + d;
+    }
+    return cp;
+}
+
+// 32-bit FNV-1a hash of names for SymbolTable and SharedInterner. It takes one byte at a
+// time, so the lexer can compute it while it reads an identifier.
+struct SymbolHash {
+    static constexpr uint32_t basis = 2166136261u;
+    static constexpr uint32_t prime = 16777619u;
+
+    static uint32_t of(std::string_view name) {
+        uint32_t h = basis;
+        for (char c : name) h = (h ^ static_cast<unsigned char>(c)) * prime;
+        return h;
+    }
+};
+
+// Bump allocator for names and decoded strings. Memory is taken from 64 KB chunks and given
+// back only all at once by clear(), which keeps the first chunk, so a lexer that is reused for
+// many inputs does not allocate again. Like in TokenWriter, reserve(n) gives room for at most
+// n chars and commit(end) takes only what was really used.
+class StringArena {
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* chunkPos = nullptr;
+    char* chunkEnd = nullptr;
+
+public:
+    char* reserve(size_t n) {
+        if (static_cast<size_t>(chunkEnd - chunkPos) < n) {
+            size_t size = std::max<size_t>(n, 64 * 1024);
+            chunks.emplace_back(new char[size]);
+            chunkPos = chunks.back().get();
+            chunkEnd = chunkPos + size;
+        }
+        return chunkPos;
+    }
+
+    void commit(char* end) { chunkPos = end; }
+
+    // Copies text into the arena and returns the copy.
+    std::string_view store(std::string_view text) {
+        char* begin = reserve(text.size());
+        if (!text.empty()) std::memcpy(begin, text.data(), text.size());
+        commit(begin + text.size());
+        return std::string_view(begin, text.size());
+    }
+
+    void clear() {
+        if (chunks.empty()) return;
+        chunks.resize(1);
+        chunkPos = chunks[0].get();
+        chunkEnd = chunkPos + 64 * 1024;
+    }
+};
+
+// The hash part of SymbolTable and of every SharedInterner shard: an open addressing table of
+// (hash, id) slots with linear probing. The names are not in it, the owner compares them
+// by id. The table is kept at most half full, so probe chains stay short.
+class SymbolSlots {
+    struct Slot {
+        uint32_t hash;
+        uint32_t id;     // 0 = empty slot
+    };
+    std::vector<Slot> slots;
+    size_t count = 0;
+
+public:
+    // capacity must be a power of two.
+    explicit SymbolSlots(size_t capacity) : slots(capacity) {}
+
+    // Returns the id of the entry with this hash for which same(id) is true. If there is
+    // none, add() is called for the id of a new entry.
+    template <typename Same, typename Add>
+    uint32_t findOrAdd(uint32_t hash, Same same, Add add) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (slot.id == 0) {
+                uint32_t id = add();
+                slot = { hash, id };
+                if (++count * 2 > slots.size()) grow();
+                return id;
+            }
+            if (slot.hash == hash && same(slot.id)) return slot.id;
+        }
+    }
+
+    size_t size() const { return count; }
+
+private:
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot& slot : old) {
+            if (slot.id == 0) continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].id != 0) i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
+
+// SharedInterner is a process wide name table for multi-file and batch runs. All workers
+// share it, so every distinct name is stored once per process and has the same id in every
+// token stream. Ids are dense (1, 2, 3, ...) and come from one atomic counter.
+// The table is split into 64 shards by the hash, every shard has its own lock, so threads
+// interning different names rarely wait for each other. name(id) takes no lock at all: it
+// reads a page directory that only ever grows. A thread must get the id through intern() or
+// through normal synchronisation with the thread that interned it (a join, a queue ...).
+// With a path, the table is loaded from that file (mapped with mmap, names are used in place)
+// and save() writes it back. Names keep their ids, so ids stay stable across runs and
+// indexes built on them stay valid.
+class SharedInterner {
+    static constexpr size_t shardCount = 64;
+    static constexpr size_t pageBits = 16;
+    static constexpr size_t pageCount = size_t(1) << 16;
+
+    struct Shard {
+        std::mutex m;
+        SymbolSlots slots{256};
+        StringArena names;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+    std::unique_ptr<std::atomic<std::string_view*>[]> pages;
+    std::atomic<uint32_t> nextId{1};
+    std::string path;
+    const char* mapped = nullptr;
+    size_t mappedSize = 0;
+
+public:
+    explicit SharedInterner(std::string path = {})
+        : shards(new Shard[shardCount]), pages(new std::atomic<std::string_view*>[pageCount]), path(std::move(path)) {
+        for (size_t i = 0; i < pageCount; ++i) pages[i].store(nullptr, std::memory_order_relaxed);
+        if (this->path.empty()) return;
+        // If load() throws, the destructor does not run, so the pages and the mapping it
+        // made so far must be given back here.
+        try {
+            load();
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    SharedInterner(const SharedInterner&) = delete;
+    SharedInterner& operator=(const SharedInterner&) = delete;
+
+    ~SharedInterner() { release(); }
+
+    uint32_t intern(std::string_view name) { return intern(name, SymbolHash::of(name)); }
+
+    uint32_t intern(std::string_view name, uint32_t hash) { return insert(name, hash, true); }
+
+    std::string_view name(uint32_t id) const {
+        return pages[id >> pageBits].load(std::memory_order_acquire)[id & ((size_t(1) << pageBits) - 1)];
+    }
+
+    size_t size() const { return nextId.load() - 1; }
+
+    // Writes all names in id order to the file given to the constructor. The file is
+    // written next to it and then renamed, so a reader never sees half a file.
+    // File layout: "JSYM", version, count (u32 each), count + 1 end offsets (u32), names.
+    void save() const {
+        if (path.empty()) throw std::runtime_error("SharedInterner has no file to save to");
+        uint32_t count = static_cast<uint32_t>(size());
+        std::string temp = path + ".tmp" + std::to_string(::getpid());
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("Cannot create file " + temp);
+        try {
+            TokenWriter out(fd);
+            uint32_t header[3] = { 0, symbolFileVersion, count };
+            std::memcpy(header, symbolFileMagic, 4);
+            out.write(std::string_view(reinterpret_cast<const char*>(header), sizeof header));
+            uint32_t end = 0;
+            out.write(std::string_view(reinterpret_cast<const char*>(&end), 4));
+            for (uint32_t id = 1; id <= count; ++id) {
+                end += static_cast<uint32_t>(name(id).size());
+                out.write(std::string_view(reinterpret_cast<const char*>(&end), 4));
+            }
+            for (uint32_t id = 1; id <= count; ++id) out.write(name(id));
+            out.flush();
+        } catch (...) {
+            ::close(fd);
+            ::unlink(temp.c_str());
+            throw;
+        }
+        if (::close(fd) != 0 || ::rename(temp.c_str(), path.c_str()) != 0) {
+            ::unlink(temp.c_str());
+            throw std::runtime_error("Failed to write symbol file " + path);
+        }
+    }
+
+private:
+    static constexpr char symbolFileMagic[4] = { 'J', 'S', 'Y', 'M' };
+    static constexpr uint32_t symbolFileVersion = 1;
+
+    // Finds name or adds it. If copy is false, the name is used as it is (it points into
+    // the mapped file) instead of being copied into the shard.
+    uint32_t insert(std::string_view name, uint32_t hash, bool copy) {
+        Shard& shard = shards[hash >> 26];
+        std::lock_guard<std::mutex> lock(shard.m);
+        return shard.slots.findOrAdd(
+            hash, [&](uint32_t id) { return this->name(id) == name; },
+            [&] {
+                uint32_t id = nextId.fetch_add(1);
+                publish(id, copy ? shard.names.store(name) : name);
+                return id;
+            });
+    }
+
+    void release() {
+        for (size_t i = 0; i < pageCount; ++i) delete[] pages[i].exchange(nullptr, std::memory_order_relaxed);
+        if (mapped) ::munmap(const_cast<char*>(mapped), mappedSize);
+        mapped = nullptr;
+    }
+
+    void publish(uint32_t id, std::string_view name) {
+        std::atomic<std::string_view*>& page = pages[id >> pageBits];
+        std::string_view* entries = page.load(std::memory_order_acquire);
+        if (!entries) {
+            std::string_view* fresh = new std::string_view[size_t(1) << pageBits];
+            if (page.compare_exchange_strong(entries, fresh, std::memory_order_acq_rel)) entries = fresh;
+            else delete[] fresh;
+        }
+        entries[id & ((size_t(1) << pageBits) - 1)] = name;
+    }
+
+    // Maps the file and adds its names in order, so name number i gets id i again.
+    // A missing file is fine (first run), a broken one is an error.
+    void load() {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return;
+        }
+        mappedSize = static_cast<size_t>(st.st_size);
+        void* p = ::mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("Cannot map file " + path);
+        mapped = static_cast<const char*>(p);
+        uint32_t header[3] = {};
+        if (mappedSize >= sizeof header) std::memcpy(header, mapped, sizeof header);
+        uint64_t count = header[2];
+        const char* ends = mapped + sizeof header;
+        const char* blob = ends + (count + 1) * 4;
+        bool ok = mappedSize >= sizeof header && std::memcmp(mapped, symbolFileMagic, 4) == 0
+            && header[1] == symbolFileVersion && (count + 1) * 4 <= mappedSize - sizeof header;
+        uint32_t begin = 0;
+        for (uint64_t i = 1; ok && i <= count; ++i) {
+            uint32_t end;
+            std::memcpy(&end, ends + i * 4, 4);
+            if (end < begin || blob + end > mapped + mappedSize) {
+                ok = false;
+                break;
+            }
+            std::string_view name(blob + begin, end - begin);
+            // A name that is already there would shift all ids after it.
+            if (insert(name, SymbolHash::of(name), false) != i) ok = false;
+            begin = end;
+        }
+        if (!ok) throw std::runtime_error("Not a symbol file or wrong version: " + path);
+    }
+};
+
+// SymbolTable interns names: every distinct name is stored once and gets a small dense id
+// (1, 2, 3, ... in order of first appearance, 0 means "no symbol"). Tools after the lexer can
+// then compare and hash names as integers, and a name used a thousand times costs nothing extra.
+// It is an open addressing hash table of (hash, id) slots (SymbolSlots), the names themselves
+// are copied into a StringArena, so the table does not depend on the lifetime of the source.
+// With a SharedInterner as parent, the table is a per-thread cache in front of it: ids are
+// the shared ones and names are stored only in the shared table. A worker then takes the
+// shared lock only for the first use of every name in its own inputs.
+class SymbolTable {
+    SymbolSlots slots;
+    std::vector<std::string_view> names;
+    SharedInterner* shared;
+    StringArena strings;
+
+public:
+    explicit SymbolTable(SharedInterner* shared = nullptr) : slots(1024), names(1), shared(shared) {}
+
+    uint32_t intern(std::string_view name) { return intern(name, SymbolHash::of(name)); }
+
+    // hash must be SymbolHash::of(name), the lexer passes the one it has computed already.
+    uint32_t intern(std::string_view name, uint32_t hash) {
+        return slots.findOrAdd(
+            hash, [&](uint32_t id) { return this->name(id) == name; },
+            [&] {
+                if (shared) return shared->intern(name, hash);
+                names.push_back(strings.store(name));
+                return static_cast<uint32_t>(names.size() - 1);
+            });
+    }
+
+    std::string_view name(uint32_t id) const { return shared ? shared->name(id) : names[id]; }
+
+    // Number of names seen by this table. Without a parent, ids go from 1 to size().
+    size_t size() const { return slots.size(); }
+};
+
+// Trivia is everything between tokens: whitespace (with newlines), comments if
+// LexerConfig::commentsAsTrivia is on, and unknown characters that the lexer skips.
+enum class TriviaKind : uint8_t { Whitespace, LineComment, BlockComment, Unknown };
+
+struct Trivia {
+    TriviaKind kind;
+    std::string_view text;
+};
+
+// Side table with the leading trivia of every token, for formatters and codemods. Token i
+// (in the order next() returns them) has the pieces leading(i), they are the source text
+// right before it, so leadingText(0) + lexeme 0 + leadingText(1) + lexeme 1 + ... up to the
+// EndOfFile token gives the input again, byte for byte.
+// The tokens do not get bigger for this: pieces are in one vector and per token only the
+// index of its first piece is stored.
+class TriviaTable {
+    std::vector<Trivia> pieces;
+    std::vector<uint32_t> first;   // first[i] = index of the first piece of token i
+
+public:
+    // Number of tokens seen.
+    size_t size() const { return first.size(); }
+
+    std::span<const Trivia> leading(size_t token) const {
+        size_t end = token + 1 < first.size() ? first[token + 1] : pieces.size();
+        return std::span<const Trivia>(pieces.data() + first[token], end - first[token]);
+    }
+
+    // All leading trivia of a token as one piece of the source (the pieces are next to each other).
+    std::string_view leadingText(size_t token) const {
+        std::span<const Trivia> span = leading(token);
+        if (span.empty()) return {};
+        const char* begin = span.front().text.data();
+        return std::string_view(begin, span.back().text.data() + span.back().text.size() - begin);
+    }
+
+    void clear() {
+        pieces.clear();
+        first.clear();
+    }
+
+    // Used by the lexer: beginToken() before a token is read, then add() for every piece.
+    // Unknown characters next to each other are joined into one piece.
+    void beginToken() { first.push_back(static_cast<uint32_t>(pieces.size())); }
+    void add(TriviaKind kind, std::string_view text) {
+        if (kind == TriviaKind::Unknown && !pieces.empty() && pieces.back().kind == kind
+            && pieces.back().text.data() + pieces.back().text.size() == text.data()) {
+            pieces.back().text = std::string_view(pieces.back().text.data(), pieces.back().text.size() + text.size());
+            return;
+        }
+        pieces.push_back({ kind, text });
+    }
+};
+
+// Writes code point cp as UTF-8 and moves out behind it. Lone surrogates are written like
+// other code points (WTF-8), JavaScript strings can have them.
+inline void appendUtf8(char*& out, uint32_t cp) {
+    if (cp < 0x80) {
+        *out++ = static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        *out++ = static_cast<char>(0xC0 | (cp >> 6));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *out++ = static_cast<char>(0xE0 | (cp >> 12));
+        *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        *out++ = static_cast<char>(0xF0 | (cp >> 18));
+        *out++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// LexerConfig is everything about the language that does not change between runs:
+// the keyword set and dialect options. It is built once and shared (read only) by any
+// number of lexers and threads, so making a lexer does not build a keyword set anymore.
+struct LexerConfig {
+    std::unordered_set<std::string_view> keywords = {
         "var", "if", "else", "function", "return", "let", "const", "while"
     };
+    // If true, '+' or '-' right before a digit is read as the sign of the number ("-12.5").
+    bool signedNumbers = true;
+    // If true and the lexer has a symbol table, String tokens are interned too (with quotes).
+    bool internStrings = false;
+    // If true, Number tokens get their parsed value in Token::value() (see parseNumber).
+    bool parseNumbers = false;
+    // If true, String tokens get their decoded value in Token::decoded().
+    bool decodeStrings = false;
+    // If true, comments are not tokens, they are only trivia (see BasicLexer::setTrivia).
+    // Consumers that do not want comments do not see them at all.
+    bool commentsAsTrivia = false;
+
+    // The default configuration, shared by all lexers that do not get their own.
+    static const LexerConfig& defaults() {
+        static const LexerConfig config;
+        return config;
+    }
+};
+
+template <typename Observer = NullObserver>
+class BasicLexer {
+    const LexerConfig* config;
+    // Per-run state, reset() sets it up for a new input.
+    std::string_view input;
+    size_t pos = 0;
+    int line = 1, col = 1;
+    // Token storage for lex(), it keeps its capacity between runs.
+    std::vector<Token> storage;
+    // If set, identifiers and keywords are interned here. It is kept by reset().
+    SymbolTable* symbols = nullptr;
+    // Decoded strings with escapes go to arena if set, otherwise to ownArena.
+    StringArena ownArena;
+    StringArena* arena = nullptr;
+    // One entry per open ${ of a template literal: the number of '{' opened inside it and not
+    // closed yet. A '}' when the top is 0 ends the substitution and the template goes on.
+    std::vector<uint32_t> templateBraces;
+    // True if a '/' now starts a regular expression, it depends on the last token that is not
+    // a comment (see regexCanFollow).
+    bool regexAllowed = true;
+    // If set, the leading trivia of every token is recorded here.
+    TriviaTable* trivia = nullptr;
+    // True if a line break was seen since the last token that is not a comment.
+    bool lineBreak = false;
+    [[no_unique_address]] Observer observer;
 
 public:
-    // Constructor takes the entire input code as a single string and stores it.
+    // Constructor takes the entire input code as a single string and remembers it.
     // I do this such way so lexer be able to read characters one by one later.
+    // The input is not copied: the caller must keep it alive as long as the lexer and
+    // the tokens are used, because token lexemes point into it.
     // The fields pos, line and col are initialized here to start at the beginning.
-    Lexer(const std::string& src) : input(src) {}
+    // The observer is copied in, use getObserver() to read its state after tokenize().
+    BasicLexer(std::string_view src, Observer obs = Observer())
+        : BasicLexer(src, LexerConfig::defaults(), std::move(obs)) {}
+
+    // The config is not copied either, it must live longer than the lexer.
+    BasicLexer(std::string_view src, const LexerConfig& config, Observer obs = Observer())
+        : config(&config), input(src), observer(std::move(obs)) {}
+
+    // A lexer without input, for reuse with reset() or lex().
+    BasicLexer() : BasicLexer(std::string_view()) {}
+
+    Observer& getObserver() { return observer; }
+    const LexerConfig& getConfig() const { return *config; }
+
+    // Turns on interning of Identifier and Keyword names (nullptr turns it off).
+    // The table is not owned by the lexer and can be shared by runs over many inputs,
+    // then the same name gets the same id in all of them.
+    void setSymbols(SymbolTable* table) { symbols = table; }
+
+    // Decoded strings are put into this arena instead of the lexer's own one (nullptr goes
+    // back to the own one). reset() does not clear it, so tokens of many runs stay valid.
+    void setArena(StringArena* strings) { arena = strings; }
+
+    // Turns on the lossless mode: the whitespace, comments (with commentsAsTrivia) and
+    // skipped characters before every token go to table (nullptr turns it off). The table
+    // is not owned by the lexer, reset() clears it, it is for one run.
+    void setTrivia(TriviaTable* table) { trivia = table; }
+
+    // Starts over on a new input. Nothing is freed, so a lexer that is reused for many
+    // small inputs does not allocate once its buffers are big enough.
+    // Decoded strings of the last run in the lexer's own arena are dropped here.
+    void reset(std::string_view src) {
+        input = src;
+        pos = 0;
+        line = 1;
+        col = 1;
+        ownArena.clear();
+        templateBraces.clear();
+        regexAllowed = true;
+        lineBreak = false;
+        if (trivia) trivia->clear();
+    }
+
+    // reset(src) and tokenize into the lexer's own vector. The returned tokens are valid
+    // until the next lex() call, the vector keeps its capacity between calls.
+    const std::vector<Token>& lex(std::string_view src) {
+        reset(src);
+        tokenize(storage);
+        return storage;
+    }
 
     // I create a vector tokens to collect all found tokens.
-    std::vector<Token> tokenize(bool trace = false) {
+    // It is tokenize(sink) with a sink that pushes into the vector.
+    std::vector<Token> tokenize() {
         std::vector<Token> tokens;
-        
+        tokenize(tokens);
+        return tokens;
+    }
+
+    // Same, but into a vector of the caller. It is cleared first, its capacity is kept.
+    void tokenize(std::vector<Token>& tokens) {
+        tokens.clear();
+        VectorSink sink{ &tokens };
+        tokenize(sink);
+    }
+
+    // Push API: every token (EndOfFile too) goes straight to sink.onToken(const Token&).
+    // The sink type is a template parameter like the observer, so the call is inlined and
+    // tokens are not stored anywhere. Counting or hashing tokens this way needs no heap at all.
+    template <typename Sink>
+    void tokenize(Sink& sink) {
+        while (true) {
+            Token t = next();
+            sink.onToken(t);
+            if (t.type == TokenType::EndOfFile) break;
+        }
+    }
+
+    // Pull API: next() reads only one token and returns it, so the caller can stop early
+    // (for example after a "use strict" directive) and no vector is needed.
+    // After the end of input it returns EndOfFile, also on every later call.
+    Token next() {
+        if (trivia) trivia->beginToken();
+        Token t = scan();
+        if (t.type != TokenType::Comment) regexAllowed = regexCanFollow(t);
+        return t;
+    }
+
+    // C++20 input range over next(), so tokens can be used in a range-for or with std::views:
+    //   for (const Token& t : lexer.tokens()) ...
+    // The range ends after the EndOfFile token. Only one token is kept in memory.
+    TokenStream<BasicLexer> tokens() { return TokenStream<BasicLexer>(*this); }
+
+private:
+    // Reads the next token for next(). A '/' is a regular expression if regexAllowed says so.
+    Token scan() {
         // Here I skip whitespace, tabs, and newline characters.
         // When lexer see '\n', it increase the line counter and reset column to 1.
         // This is needed so programm correctly track where it is in the file.
         while (pos < input.size()) {
-            while (pos < input.size() && isspace(input[pos])) {
-                if (input[pos] == '\n') { ++line; col = 1; }
+            size_t spaceStart = pos;
+            while (pos < input.size() && asciiClass.is(input[pos], AsciiClassTable::Space)) {
+                if (input[pos] == '\n') { ++line; col = 1; lineBreak = true; }
                 else ++col;
                 ++pos;
             }
+            if (trivia && pos > spaceStart) trivia->add(TriviaKind::Whitespace, input.substr(spaceStart, pos - spaceStart));
             // Check again, because after skipping whitespace programm can be at the end.
             if (pos >= input.size()) break;
             // Reads the current character to decide what to do next.
@@ -57,235 +1699,474 @@ public:
             
             // Here programm check each possible token start:
             // 1) If we see '+' or '-' followed by a digit, start reading a signed number.
-            // 2) If just a digit, read a number.
-            // 3) If a letter or '_' or '$', read an identifier (or keyword).
+            // 2) If just a digit, or '.' and a digit (".5"), read a number.
+            // 3) If a letter or '_' or '$', read an identifier (or keyword). Names can also start
+            //    with a non-ASCII letter or a \u escape, this is checked last because it is rare.
             // 4) If see a quote, I read a string literal.
-            // 5) If  see '/' next to '/' or '*', read a comment.
-            // 6) If it is an operator character, call readOperator.
-            // 7) If it is punctuation (brackets, commas, semicolons), call readPunctuation.
+            // 5) If  see '/' next to '/' or '*', read a comment. Another '/' where an expression
+            //    can start is a regular expression.
+            //    A backtick, or a '}' that closes a ${ substitution, reads a template part.
+            // 6) If it is an operator or punctuation character (brackets, commas, semicolons),
+            //    call readOperatorFA, it knows both.
             // Otherwise just go on to avoid getting stuck on unknown character.
-            if ((c == '+' || c == '-') && pos + 1 < input.size() && isdigit(input[pos + 1])) {
-                tokens.push_back(readNumberFA(trace));
-            } else if (isdigit(c)) {
-                tokens.push_back(readNumberFA(trace));
-            } else if (isalpha(c) || c == '_' || c == '$') {
-                tokens.push_back(readIdentifierFA(trace));
+            if ((c == '+' || c == '-') && config->signedNumbers && pos + 1 < input.size() && isDecimalDigit(input[pos + 1])) {
+                return readNumberFA();
+            } else if (isDecimalDigit(c)) {
+                return readNumberFA();
+            } else if (c == '.' && pos + 1 < input.size() && isDecimalDigit(input[pos + 1])) {
+                return readNumberFA();
+            } else if (asciiClass.is(c, AsciiClassTable::IdStart)) {
+                return readIdentifierFA();
             }else if (c == '"' || c == '\'') {
-                tokens.push_back(readStringFA(trace));
+                return readStringFA();
             } else if (c == '/' && pos + 1 < input.size() && (input[pos + 1] == '/' || input[pos + 1] == '*')) {
-                tokens.push_back(readCommentFA(trace));
-            } else if (isOperatorChar(c)) {
-                tokens.push_back(readOperatorFA(trace));
-            } else if (isPunctuation(c)) {
-                tokens.push_back(readPunctuation(trace));
+                int commentLine = line;
+                Token comment = readCommentFA();
+                // A line break inside a block comment counts for the next token.
+                bool multiLine = line != commentLine;
+                if (!config->commentsAsTrivia) {
+                    emit(comment);
+                    lineBreak = lineBreak || multiLine;
+                    return comment;
+                }
+                lineBreak = lineBreak || multiLine;
+                if (trivia) {
+                    trivia->add(comment.lexeme[1] == '/' ? TriviaKind::LineComment : TriviaKind::BlockComment, comment.lexeme);
+                }
+            } else if (c == '/' && regexAllowed) {
+                return readRegExpFA();
+            } else if (c == '`') {
+                return readTemplateFA();
+            } else if (c == '}' && !templateBraces.empty() && templateBraces.back() == 0) {
+                templateBraces.pop_back();
+                return readTemplateFA();
+            } else if (isPunctuatorStart(c)) {
+                return readOperatorFA();
+            } else if ((c == '\\' || static_cast<unsigned char>(c) >= 0x80) && unicodeIdentifierStart()) {
+                return readIdentifierFA();
             }else {
+                if (trivia) trivia->add(TriviaKind::Unknown, input.substr(pos, 1));
                 ++pos;
                 ++col;
             }
         }
-        // After finishing all checks, push an EndOfFile token.
-        tokens.push_back({ TokenType::EndOfFile, "", line, col });
-        return tokens;
+        // A ${ that is never closed means the template literal is not finished.
+        if (!templateBraces.empty()) {
+            throw std::runtime_error("Unterminated template literal at line " + std::to_string(line) + ", col " + std::to_string(col));
+        }
+        // After finishing all checks, return an EndOfFile token.
+        Token t = { TokenType::EndOfFile, "", line, col, pos };
+        emit(t);
+        return t;
+    }
+
+    // Every token goes through here on its way to the observer. The flags that do not belong
+    // to one reader are set here: NewlineBefore, and NonAscii for tokens with a body. The
+    // body was just read, so the SWAR test of its bytes is cheap. Identifiers set it themselves.
+    void emit(Token& t) {
+        if (lineBreak) {
+            t.set(TokenFlag::NewlineBefore);
+            if (t.type != TokenType::Comment) lineBreak = false;
+        }
+        if ((t.type == TokenType::String || t.type == TokenType::Template || t.type == TokenType::Comment
+             || t.type == TokenType::RegExp) && hasNonAscii(t.lexeme)) {
+            t.set(TokenFlag::NonAscii);
+        }
+        observer.onToken(t);
+    }
+
+    // True for the words after which an expression starts. Most of them are not in
+    // LexerConfig::keywords and come as Identifier tokens, so regexCanFollow asks for both.
+    // This runs for every name, so the length is checked first and only words of that
+    // length are compared.
+    static bool isWordBeforeExpression(std::string_view w) {
+        switch (w.size()) {
+            case 2: return w == "in" || w == "of" || w == "do";
+            case 3: return w == "new";
+            case 4: return w == "void" || w == "case" || w == "else";
+            case 5: return w == "throw" || w == "yield" || w == "await";
+            case 6: return w == "return" || w == "typeof" || w == "delete";
+            case 10: return w == "instanceof";
+            default: return false;
+        }
+    }
+
+    // A '/' after t starts a regular expression if t can not end an expression: at the start,
+    // after an operator, after "(" "," "{" "}" ";" and such, after a word like return or typeof,
+    // and inside a ${ substitution. After a name, a literal, ")" or "]" it is division.
+    // "}" is taken as the end of a block, "++" and "--" as postfix.
+    static bool regexCanFollow(const Token& t) {
+        switch (t.type) {
+            case TokenType::Operator:
+                return t.op() != Op::Inc && t.op() != Op::Dec;
+            case TokenType::Punctuation:
+                return t.punc() != Punc::RParen && t.punc() != Punc::RBracket;
+            case TokenType::Keyword:
+            case TokenType::Identifier:
+                return isWordBeforeExpression(t.lexeme);
+            case TokenType::Template:
+                return t.templatePart() == TemplatePart::Head || t.templatePart() == TemplatePart::Middle;
+            default:
+                return false;
+        }
     }
 
-private:
     // This function reads identifiers and keywords using a small DFA.
     // We use states: START (before reading), IDENT (reading letters/digits/_/$), ACCEPT (done).
-    Token readIdentifierFA(bool trace) {
+    // The hash of the name for the symbol table is computed here byte by byte while the
+    // characters are read, so interning does not have to read the name again.
+    // Names can have Unicode letters in UTF-8 ("café", "π") and \u escapes. In IDENT the ASCII
+    // fast lane loads 8 bytes, and if no byte has the high bit set they are checked only with
+    // the asciiClass table. Only a byte >= 0x80 or a '\\' goes to takeUnicodeIdChar.
+    // A name with escapes is decoded into the arena (Token::decoded()) and interned decoded,
+    // so "\u0061b" and "ab" get the same symbol. It is never a keyword.
+    Token readIdentifierFA() {
         enum class State { START, IDENT, ACCEPT };
         State state = State::START;
-        std::string buf;
         int startCol = col;
+        size_t start = pos;
+        uint32_t hash = SymbolHash::basis;
+        bool hasEscape = false, nonAscii = false;
 
-        while (pos < input.size()) {
+        while (pos < input.size() && state != State::ACCEPT) {
             char c = input[pos];
             switch (state) {
                 case State::START:
                     // In START, we expect a letter, '_' or '$' to begin identifier.
-                    // If it matches, we add to buf, move pos, update col, go to IDENT.
-                    if (isalpha(c) || c == '_' || c == '$') {
-                        buf += c;
+                    // If it matches, we move pos, update col, go to IDENT.
+                    if (asciiClass.is(c, AsciiClassTable::IdStart)) {
+                        hash = (hash ^ static_cast<unsigned char>(c)) * SymbolHash::prime;
                         pos++;
                         col++;
                         state = State::IDENT;
+                    } else if (takeUnicodeIdChar(true, hash, hasEscape, nonAscii)) {
+                        state = State::IDENT;
                     } else {
                         // If not valid start char, go to ACCEPT (should not happen normally).
                         state = State::ACCEPT;
                     }
                     break;
 
-                case State::IDENT:
+                case State::IDENT: {
                     // In IDENT, we accept letters, digits, '_' and '$'.
-                    // If char matches, add to buf and continue in IDENT.
-                    if (isalnum(c) || c == '_' || c == '$') {
-                        buf += c;
+                    // First the fast lane for a whole block of ASCII.
+                    size_t blockEnd = pos + 8;
+                    if (blockEnd <= input.size() && asciiBlock(pos)) {
+                        while (pos < blockEnd && asciiClass.is(input[pos], AsciiClassTable::IdPart)) {
+                            hash = (hash ^ static_cast<unsigned char>(input[pos])) * SymbolHash::prime;
+                            pos++;
+                            col++;
+                        }
+                        if (pos == blockEnd) break;
+                    }
+                    // One char: ASCII, or a Unicode letter or escape. When next char is not
+                    // valid, go to ACCEPT.
+                    c = input[pos];
+                    if (asciiClass.is(c, AsciiClassTable::IdPart)) {
+                        hash = (hash ^ static_cast<unsigned char>(c)) * SymbolHash::prime;
                         pos++;
                         col++;
-                    } else {
-                        // When next char is not valid, go to ACCEPT.
+                    } else if (!takeUnicodeIdChar(false, hash, hasEscape, nonAscii)) {
                         state = State::ACCEPT;
                     }
                     break;
+                }
 
                 case State::ACCEPT:
-                    // We break out when we reach ACCEPT.
-                    goto done;
+                    break;
             }
         }
 
-    done:
-        // After loop, buf holds full lexeme. Check if it's a keyword.
-        TokenType type = keywords.count(buf) ? TokenType::Keyword : TokenType::Identifier;
-        Token t = { type, buf, line, startCol };
-        if (trace) printToken(t);
+        // After loop, the lexeme is input[start, pos). Check if it's a keyword.
+        std::string_view text = input.substr(start, pos - start);
+        TokenType type = !hasEscape && config->keywords.count(text) ? TokenType::Keyword : TokenType::Identifier;
+        Token t = { type, text, line, startCol, start };
+        if (nonAscii) t.set(TokenFlag::NonAscii);
+        if (hasEscape) {
+            t.set(TokenFlag::HasEscape);
+            t.setDecoded(decodeIdentifier(text));
+            hash = SymbolHash::of(t.decoded());
+        }
+        if (symbols) t.symbol = symbols->intern(hasEscape ? t.decoded() : text, hash);
+        emit(t);
         return t;
     }
-    // In this function, I implement a determined finite automaton for numbers.
-    // First programm handle the optional sign (SIGN), then various parts: ZERO, INT_PART (integer part), DOT and FRAC_PART (fraction).
-    // Then it handle the exponent (EXP, EXP_SIGN, EXP_NUM). When all characters are read,afther that go to ACCEPT.
-    // This ensures the number has the correct format, for example no leading zeros.
+
+    // True if the 8 bytes at p are all ASCII: one test of the high bits for the whole block.
+    bool asciiBlock(size_t p) const {
+        uint64_t x;
+        std::memcpy(&x, input.data() + p, 8);
+        return (x & 0x8080808080808080ULL) == 0;
+    }
+
+    // Takes one non-ASCII ID_Start (start) or ID_Continue code point or one \u escape of such
+    // a code point at pos. Returns false and takes nothing if there is none. A malformed \u
+    // escape, or one of a char that can not be in a name, is an error.
+    bool takeUnicodeIdChar(bool start, uint32_t& hash, bool& hasEscape, bool& nonAscii) {
+        size_t length;
+        uint32_t cp;
+        if (input[pos] == '\\') {
+            if (pos + 1 >= input.size() || input[pos + 1] != 'u') return false;
+            size_t end = pos + 2;
+            cp = parseUnicodeEscape(input, end);
+            if (cp == invalidCodePoint || !(start ? isIdStart(cp) : isIdContinue(cp))) {
+                throw std::runtime_error("Invalid escape in identifier at line " + std::to_string(line) + ", col " + std::to_string(col));
+            }
+            hasEscape = true;
+            length = end - pos;
+        } else {
+            if (static_cast<unsigned char>(input[pos]) < 0x80) return false;
+            cp = decodeUtf8(input, pos, length);
+            if (cp == invalidCodePoint || !(start ? isIdStart(cp) : isIdContinue(cp))) return false;
+            nonAscii = true;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(input[pos + i])) * SymbolHash::prime;
+        }
+        pos += length;
+        col += static_cast<int>(length);
+        return true;
+    }
+
+    // True if a name starts at pos with a non-ASCII letter or a \u escape.
+    bool unicodeIdentifierStart() const {
+        size_t length;
+        uint32_t cp;
+        if (input[pos] == '\\') {
+            if (pos + 1 >= input.size() || input[pos + 1] != 'u') return false;
+            size_t end = pos + 2;
+            cp = parseUnicodeEscape(input, end);
+        } else {
+            cp = decodeUtf8(input, pos, length);
+        }
+        return cp != invalidCodePoint && isIdStart(cp);
+    }
+
+    // The name of an identifier with \u escapes, in UTF-8 in the arena. It is never longer
+    // than the escaped text. The escapes were checked by takeUnicodeIdChar already.
+    std::string_view decodeIdentifier(std::string_view text) {
+        StringArena& strings = arena ? *arena : ownArena;
+        char* begin = strings.reserve(text.size());
+        char* out = begin;
+        for (size_t i = 0; i < text.size();) {
+            if (text[i] == '\\') {
+                i += 2;
+                appendUtf8(out, parseUnicodeEscape(text, i));
+            } else {
+                *out++ = text[i++];
+            }
+        }
+        strings.commit(out);
+        return std::string_view(begin, out - begin);
+    }
+
+    // In this function, I implement a determined finite automaton for numbers. It knows all
+    // JavaScript numeric literals: decimal ("12", "1.5e-3", "1.", ".5"), hex/octal/binary
+    // ("0xFF", "0o17", "0b101"), numeric separators ("1_000_000") and BigInt ("10n", "0xFFn").
+    // First programm handle the optional sign (SIGN), then the start: ZERO (it can be a radix
+    // prefix), INT_PART (integer part) or LEADING_DOT (".5"). Then DOT and FRAC_PART (fraction),
+    // the exponent (EXP, EXP_SIGN, EXP_NUM), the digits after a radix prefix (RADIX_START,
+    // RADIX_PART) and the BigInt suffix (BIGINT). SEPARATOR is after '_', it needs a digit of the
+    // same part and then goes back there (afterSeparator). When all characters are read, go to ACCEPT.
+    // Runs of decimal digits are skipped 8 bytes at a time by skipDigits.
+    // This ensures the number has the correct format, for example no leading zeros and no "1__0".
     // If it see an invalid character (like a letter after digits) throw an error.
-    Token readNumberFA(bool trace) {
+    Token readNumberFA() {
         enum class State {
-            START, SIGN, ZERO, INT_PART, DOT, FRAC_PART,
-            EXP, EXP_SIGN, EXP_NUM, ACCEPT, ERROR
+            START, SIGN, ZERO, INT_PART, LEADING_DOT, DOT, FRAC_PART,
+            EXP, EXP_SIGN, EXP_NUM, RADIX_START, RADIX_PART, SEPARATOR, BIGINT, ACCEPT
         };
 
         State state = State::START;
-        std::string buf;
+        State afterSeparator = State::INT_PART;
+        int radix = 10;
+        bool integer = true, bigInt = false, separator = false;
         int startCol = col;
+        size_t start = pos;
 
-        while (pos < input.size()) {
+        auto malformed = [&](const char* what) {
+            throw std::runtime_error(std::string(what) + " at line " + std::to_string(line) + ", column " + std::to_string(startCol));
+        };
+        // take current char and go to the next state
+        auto take = [&](State next) {
+            pos++; col++;
+            state = next;
+            if (next == State::DOT || next == State::LEADING_DOT || next == State::EXP) integer = false;
+            else if (next == State::SEPARATOR) separator = true;
+            else if (next == State::BIGINT) bigInt = true;
+        };
+        auto takeDigits = [&]() {
+            size_t end = skipDigits(input, pos);
+            col += static_cast<int>(end - pos);
+            pos = end;
+        };
+
+        while (pos < input.size() && state != State::ACCEPT) {
             char c = input[pos];
             switch (state) {
                 case State::START:
-                    if (c == '+' || c == '-') {
-                        buf += c; pos++; col++;
-                        state = State::SIGN;
-                    } else if (c == '0') {
-                        buf += c; pos++; col++;
-                        state = State::ZERO;
-                    } else if (isdigit(c)) {
-                        buf += c; pos++; col++;
-                        state = State::INT_PART;
-                    } else {
-                        goto done;
-                    }
+                    // tokenize calls us only on a sign, a digit or a '.' before a digit.
+                    if (c == '+' || c == '-') take(State::SIGN);
+                    else if (c == '0') take(State::ZERO);
+                    else if (c == '.') take(State::LEADING_DOT);
+                    else state = State::INT_PART;
                     break;
 
                 case State::SIGN:
-                    if (c == '0') {
-                        buf += c; pos++; col++;
-                        state = State::ZERO;
-                    } else if (isdigit(c)) {
-                        buf += c; pos++; col++;
-                        state = State::INT_PART;
-                    } else {
-                        throw std::runtime_error("Malformed number at line " + std::to_string(line) + ", column " + std::to_string(startCol));
-                    }
+                    if (c == '0') take(State::ZERO);
+                    else if (isDecimalDigit(c)) state = State::INT_PART;
+                    else malformed("Malformed number");
                     break;
 
                 case State::ZERO:
-                    if (isdigit(c)) {
+                    if (isDecimalDigit(c)) {
                         throw std::runtime_error("Invalid number: leading zeros not allowed at line " + std::to_string(line) + ", col " + std::to_string(startCol));
+                    } else if (c == 'x' || c == 'X') {
+                        radix = 16;
+                        take(State::RADIX_START);
+                    } else if (c == 'o' || c == 'O') {
+                        radix = 8;
+                        take(State::RADIX_START);
+                    } else if (c == 'b' || c == 'B') {
+                        radix = 2;
+                        take(State::RADIX_START);
                     } else if (c == '.') {
-                        buf += c; pos++; col++;
-                        state = State::DOT;
+                        take(State::DOT);
                     } else if (c == 'e' || c == 'E') {
-                        buf += c; pos++; col++;
-                        state = State::EXP;
+                        take(State::EXP);
+                    } else if (c == 'n') {
+                        take(State::BIGINT);
                     } else {
                         state = State::ACCEPT;
                     }
                     break;
 
                 case State::INT_PART:
-                    if (isdigit(c)) {
-                        buf += c; pos++; col++;
+                    takeDigits();
+                    if (pos >= input.size()) break;
+                    c = input[pos];
+                    if (c == '_') {
+                        afterSeparator = State::INT_PART;
+                        take(State::SEPARATOR);
                     } else if (c == '.') {
-                        buf += c; pos++; col++;
-                        state = State::DOT;
+                        take(State::DOT);
                     } else if (c == 'e' || c == 'E') {
-                        buf += c; pos++; col++;
-                        state = State::EXP;
+                        take(State::EXP);
+                    } else if (c == 'n') {
+                        take(State::BIGINT);
                     } else {
                         state = State::ACCEPT;
                     }
                     break;
 
+                case State::LEADING_DOT:
+                    if (isDecimalDigit(c)) state = State::FRAC_PART;
+                    else malformed("Malformed number");
+                    break;
+
                 case State::DOT:
-                    if (isdigit(c)) {
-                        buf += c; pos++; col++;
-                        state = State::FRAC_PART;
-                    } else {
-                        throw std::runtime_error("Malformed number at line " + std::to_string(line) + ", column " + std::to_string(startCol));
-                    }
+                    // "1." is a complete number, the fraction is optional after digits.
+                    if (isDecimalDigit(c)) state = State::FRAC_PART;
+                    else if (c == 'e' || c == 'E') take(State::EXP);
+                    else state = State::ACCEPT;
                     break;
 
                 case State::FRAC_PART:
-                    if (isdigit(c)) {
-                        buf += c; pos++; col++;
+                    takeDigits();
+                    if (pos >= input.size()) break;
+                    c = input[pos];
+                    if (c == '_') {
+                        afterSeparator = State::FRAC_PART;
+                        take(State::SEPARATOR);
                     } else if (c == 'e' || c == 'E') {
-                        buf += c; pos++; col++;
-                        state = State::EXP;
+                        take(State::EXP);
                     } else {
                         state = State::ACCEPT;
                     }
                     break;
 
                 case State::EXP:
-                    if (c == '+' || c == '-') {
-                        buf += c; pos++; col++;
-                        state = State::EXP_SIGN;
-                    } else if (isdigit(c)) {
-                        buf += c; pos++; col++;
-                        state = State::EXP_NUM;
-                    } else {
-                        throw std::runtime_error("Malformed exponent at line " + std::to_string(line) + ", column " + std::to_string(startCol));
-                    }
+                    if (c == '+' || c == '-') take(State::EXP_SIGN);
+                    else if (isDecimalDigit(c)) state = State::EXP_NUM;
+                    else malformed("Malformed exponent");
                     break;
 
                 case State::EXP_SIGN:
-                    if (isdigit(c)) {
-                        buf += c; pos++; col++;
-                        state = State::EXP_NUM;
+                    if (isDecimalDigit(c)) state = State::EXP_NUM;
+                    else malformed("Malformed exponent");
+                    break;
+
+                case State::EXP_NUM:
+                    takeDigits();
+                    if (pos < input.size() && input[pos] == '_') {
+                        afterSeparator = State::EXP_NUM;
+                        take(State::SEPARATOR);
                     } else {
-                        throw std::runtime_error("Malformed exponent at line " + std::to_string(line) + ", column " + std::to_string(startCol));
+                        state = State::ACCEPT;
                     }
                     break;
 
-                case State::EXP_NUM:
-                    if (isdigit(c)) {
-                        buf += c; pos++; col++;
+                case State::RADIX_START:
+                    if (digitValue(c) < radix) take(State::RADIX_PART);
+                    else malformed("Malformed number");
+                    break;
+
+                case State::RADIX_PART:
+                    if (digitValue(c) < radix) {
+                        take(State::RADIX_PART);
+                    } else if (c == '_') {
+                        afterSeparator = State::RADIX_PART;
+                        take(State::SEPARATOR);
+                    } else if (c == 'n') {
+                        take(State::BIGINT);
                     } else {
                         state = State::ACCEPT;
                     }
                     break;
 
+                case State::SEPARATOR:
+                    // '_' must be between two digits: not at the end, not twice in a row.
+                    if (digitValue(c) < radix) state = afterSeparator;
+                    else malformed("Malformed numeric separator");
+                    break;
+
+                case State::BIGINT:
+                    state = State::ACCEPT;
+                    break;
+
                 case State::ACCEPT:
-                    goto done;
+                    break;
             }
         }
 
-    done:
-        if (pos < input.size() && (isalnum(input[pos]) || input[pos] == '_' || input[pos] == '$')) {
-            throw std::runtime_error("Invalid token: '" + buf + input[pos] + "' at line " + std::to_string(line) + ", col " + std::to_string(startCol));
+        // At the end of input some states still wait for a digit ("1e", "0x", "1_").
+        if (state == State::SIGN || state == State::LEADING_DOT || state == State::EXP || state == State::EXP_SIGN
+            || state == State::RADIX_START || state == State::SEPARATOR) {
+            malformed(state == State::EXP || state == State::EXP_SIGN ? "Malformed exponent" : "Malformed number");
+        }
+        // A number can not be followed right away by a letter or digit ("12abc", "0b102").
+        if (pos < input.size() && asciiClass.is(input[pos], AsciiClassTable::IdPart)) {
+            throw std::runtime_error("Invalid token: '" + std::string(input.substr(start, pos - start + 1)) + "' at line " + std::to_string(line) + ", col " + std::to_string(startCol));
         }
-        Token t = { TokenType::Number, buf, line, startCol };
-        if (trace) printToken(t);
+        Token t = { TokenType::Number, input.substr(start, pos - start), line, startCol, start };
+        if (integer) t.set(TokenFlag::IsInteger);
+        if (bigInt) t.set(TokenFlag::IsBigInt);
+        if (separator) t.set(TokenFlag::HasSeparator);
+        if (config->parseNumbers) t.setValue(parseNumber(t.lexeme));
+        emit(t);
         return t;
     }
     // This function reads string literals using a DFA.
     // States: START (see opening quote), IN_STRING (reading content), ESCAPE (after '\'), ACCEPT (closing).
-    Token readStringFA(bool trace) {
+    Token readStringFA() {
         enum class State { START, IN_STRING, ESCAPE, ACCEPT };
         State state = State::START;
-        std::string buf;
-        int startCol = col;
+        int startLine = line, startCol = col;
+        size_t start = pos;
+        bool hasEscape = false;
         char quote = input[pos];  // store '"' or '\''
 
         // In START, we consume the opening quote and move to IN_STRING.
-        buf += quote;
         pos++;
         col++;
 
@@ -299,15 +2180,14 @@ private:
 
                 case State::IN_STRING:
                     if (c == '\\') {
-                        // If backslash, it's escape start. Add to buf and go to ESCAPE.
-                        buf += c;
+                        // If backslash, it's escape start. Go to ESCAPE.
                         pos++;
                         col++;
+                        hasEscape = true;
                         state = State::ESCAPE;
                     }
                     else if (c == quote) {
                         // If we see matching quote, add and accept string.
-                        buf += c;
                         pos++;
                         col++;
                         state = State::ACCEPT;
@@ -320,52 +2200,332 @@ private:
                         );
                     }
                     else {
-                        // Regular character, add and stay in IN_STRING.
-                        buf += c;
+                        // Regular characters, skip all of them up to the next quote,
+                        // backslash or newline and stay in IN_STRING.
+                        size_t end = skipStringChars(input, pos + 1, quote);
+                        col += static_cast<int>(end - pos);
+                        pos = end;
+                    }
+                    break;
+
+                case State::ESCAPE:
+                    // After '\' consume next char regardless of what it is.
+                    // A newline here is a line continuation, the string goes on in the next line.
+                    pos++;
+                    col++;
+                    if (c == '\r' && pos < input.size() && input[pos] == '\n') pos++;
+                    if (c == '\r' || c == '\n') {
+                        line++;
+                        col = 1;
+                    }
+                    // Back to IN_STRING to continue.
+                    state = State::IN_STRING;
+                    break;
+
+                case State::ACCEPT:
+                    // Once closing quote found, break out.
+                    goto done;
+            }
+        }
+
+    done:
+        if (state != State::ACCEPT) {
+            // If EOF reached without closing quote.
+            throw std::runtime_error(
+                "Unterminated string at line " + std::to_string(line) +
+                ", col " + std::to_string(startCol)
+            );
+        }
+        Token t = { TokenType::String, input.substr(start, pos - start), startLine, startCol, start };
+        if (symbols && config->internStrings) t.symbol = symbols->intern(t.lexeme);
+        if (hasEscape) t.set(TokenFlag::HasEscape);
+        if (config->decodeStrings) {
+            std::string_view body = t.lexeme.substr(1, t.lexeme.size() - 2);
+            t.setDecoded(hasEscape ? decodeString(body, startLine, startCol) : body);
+        }
+        emit(t);
+        return t;
+    }
+
+    // This function reads a regular expression literal like /ab+c/gi. States: BODY (pattern),
+    // ESCAPE (char after '\\'), CLASS (inside [...], where '/' does not end the pattern),
+    // CLASS_ESCAPE and FLAGS (letters after the closing '/'). A newline before the closing '/'
+    // is an error. Every flag letter can be used once, they are stored as bits in sub.
+    Token readRegExpFA() {
+        enum class State { BODY, ESCAPE, CLASS, CLASS_ESCAPE, FLAGS, ACCEPT };
+        State state = State::BODY;
+        int startCol = col;
+        size_t start = pos;
+        uint8_t flags = 0;
+
+        auto fail = [&](const char* what) {
+            throw std::runtime_error(std::string(what) + " at line " + std::to_string(line) + ", col " + std::to_string(startCol));
+        };
+
+        // consume the opening '/'
+        pos++;
+        col++;
+
+        while (pos < input.size() && state != State::ACCEPT) {
+            char c = input[pos];
+            if ((c == '\n' || c == '\r') && state != State::FLAGS) fail("Unterminated regular expression");
+            switch (state) {
+                case State::BODY:
+                    if (c == '/') state = State::FLAGS;
+                    else if (c == '\\') state = State::ESCAPE;
+                    else if (c == '[') state = State::CLASS;
+                    break;
+
+                case State::ESCAPE:
+                    state = State::BODY;
+                    break;
+
+                case State::CLASS:
+                    if (c == ']') state = State::BODY;
+                    else if (c == '\\') state = State::CLASS_ESCAPE;
+                    break;
+
+                case State::CLASS_ESCAPE:
+                    state = State::CLASS;
+                    break;
+
+                case State::FLAGS: {
+                    size_t letter = regExpFlagLetters.find(c);
+                    if (letter != std::string_view::npos) {
+                        uint8_t bit = static_cast<uint8_t>(1u << letter);
+                        if (flags & bit) fail("Invalid regular expression flags");
+                        flags |= bit;
+                    } else if (asciiClass.is(c, AsciiClassTable::IdPart)) {
+                        fail("Invalid regular expression flags");
+                    } else {
+                        state = State::ACCEPT;
+                        continue;   // c is not part of the token
+                    }
+                    break;
+                }
+
+                case State::ACCEPT:
+                    break;
+            }
+            pos++;
+            col++;
+        }
+
+        if (state != State::FLAGS && state != State::ACCEPT) fail("Unterminated regular expression");
+        Token t = { TokenType::RegExp, input.substr(start, pos - start), line, startCol, start };
+        t.sub = flags;
+        emit(t);
+        return t;
+    }
+
+    // This function reads one part of a template literal, it starts at the backtick or at the '}'
+    // that ends a substitution. States: IN_TEMPLATE (text, it can have newlines), ESCAPE (char
+    // after '\\'), DOLLAR (after '$', a '{' starts a substitution) and ACCEPT. The part ends at
+    // a backtick (NoSubstitution or Tail) or at "${" (Head or Middle), then the lexer goes on
+    // with normal tokens and templateBraces finds the '}' that comes back here.
+    // Plain text is skipped with skipStringChars like in strings.
+    Token readTemplateFA() {
+        enum class State { IN_TEMPLATE, ESCAPE, DOLLAR, ACCEPT };
+        State state = State::IN_TEMPLATE;
+        int startLine = line, startCol = col;
+        size_t start = pos;
+        bool first = input[pos] == '`';
+        bool hasEscape = false;
+        TemplatePart part = TemplatePart::None;
+
+        // consume the backtick or the '}'
+        pos++;
+        col++;
+
+        while (pos < input.size() && state != State::ACCEPT) {
+            char c = input[pos];
+            switch (state) {
+                case State::IN_TEMPLATE:
+                    if (c == '`') {
                         pos++;
                         col++;
+                        part = first ? TemplatePart::NoSubstitution : TemplatePart::Tail;
+                        state = State::ACCEPT;
+                    } else if (c == '\\') {
+                        pos++;
+                        col++;
+                        hasEscape = true;
+                        state = State::ESCAPE;
+                    } else if (c == '$') {
+                        pos++;
+                        col++;
+                        state = State::DOLLAR;
+                    } else if (c == '\n') {
+                        pos++;
+                        line++;
+                        col = 1;
+                    } else {
+                        size_t end = skipStringChars(input, pos + 1, '`', '$');
+                        col += static_cast<int>(end - pos);
+                        pos = end;
                     }
                     break;
 
                 case State::ESCAPE:
-                    // After '\' consume next char regardless of what it is.
-                    buf += c;
+                    // Like in strings, the char after '\\' is taken whatever it is.
                     pos++;
                     col++;
-                    // Back to IN_STRING to continue.
-                    state = State::IN_STRING;
+                    if (c == '\r' && pos < input.size() && input[pos] == '\n') pos++;
+                    if (c == '\r' || c == '\n') {
+                        line++;
+                        col = 1;
+                    }
+                    state = State::IN_TEMPLATE;
+                    break;
+
+                case State::DOLLAR:
+                    if (c == '{') {
+                        pos++;
+                        col++;
+                        part = first ? TemplatePart::Head : TemplatePart::Middle;
+                        templateBraces.push_back(0);
+                        state = State::ACCEPT;
+                    } else {
+                        // a '$' alone is just text
+                        state = State::IN_TEMPLATE;
+                    }
                     break;
 
                 case State::ACCEPT:
-                    // Once closing quote found, break out.
-                    goto done;
+                    break;
             }
         }
 
-    done:
         if (state != State::ACCEPT) {
-            // If EOF reached without closing quote.
             throw std::runtime_error(
-                "Unterminated string at line " + std::to_string(line) +
+                "Unterminated template literal at line " + std::to_string(startLine) +
                 ", col " + std::to_string(startCol)
             );
         }
-        Token t = { TokenType::String, buf, line, startCol };
-        if (trace) printToken(t);
+        Token t = { TokenType::Template, input.substr(start, pos - start), startLine, startCol, start };
+        t.sub = static_cast<uint8_t>(part);
+        if (hasEscape) t.set(TokenFlag::HasEscape);
+        emit(t);
         return t;
     }
 
+    // Decodes the escapes of a string body (without quotes) into the arena. An escape is never
+    // shorter than what it stands for in UTF-8 ("\u00E9" is 6 chars for 2 bytes, "\uD83D\uDE00"
+    // is 12 for 4), so body.size() is always enough room.
+    // Knows \b \f \n \r \t \v \0, \xNN, \uNNNN (surrogate pairs are joined), \u{N...},
+    // legacy octal (\12), line continuations (backslash before \n, \r\n, U+2028, U+2029) and
+    // the backslash before any other char, which is just dropped.
+    std::string_view decodeString(std::string_view body, int startLine, int startCol) {
+        StringArena& strings = arena ? *arena : ownArena;
+        char* begin = strings.reserve(body.size());
+        char* out = begin;
+        auto invalid = [&]() {
+            throw std::runtime_error("Invalid escape sequence in string at line " + std::to_string(startLine) + ", col " + std::to_string(startCol));
+        };
+        // Reads n hex digits at body[i] and moves i behind them.
+        auto hex = [&](size_t& i, size_t n) {
+            uint32_t value = 0;
+            for (size_t k = 0; k < n; k++, i++) {
+                int d = i < body.size() ? digitValue(body[i]) : 99;
+                if (d >= 16) invalid();
+                value = value * 16 + d;
+            }
+            return value;
+        };
+
+        size_t i = 0;
+        while (i < body.size()) {
+            const char* backslash = static_cast<const char*>(std::memchr(body.data() + i, '\\', body.size() - i));
+            size_t plain = (backslash ? static_cast<size_t>(backslash - body.data()) : body.size()) - i;
+            std::memcpy(out, body.data() + i, plain);
+            out += plain;
+            i += plain;
+            if (!backslash) break;
+
+            char c = body[++i];   // the scanner never ends a string right after a backslash
+            i++;
+            switch (c) {
+                case 'b': *out++ = '\b'; break;
+                case 'f': *out++ = '\f'; break;
+                case 'n': *out++ = '\n'; break;
+                case 'r': *out++ = '\r'; break;
+                case 't': *out++ = '\t'; break;
+                case 'v': *out++ = '\v'; break;
+                case '\n': break;
+                case '\r':
+                    if (i < body.size() && body[i] == '\n') i++;
+                    break;
+                case 'x':
+                    appendUtf8(out, hex(i, 2));
+                    break;
+                case 'u': {
+                    uint32_t cp;
+                    if (i < body.size() && body[i] == '{') {
+                        i++;
+                        cp = 0;
+                        size_t digits = 0;
+                        for (; i < body.size() && body[i] != '}'; i++, digits++) {
+                            int d = digitValue(body[i]);
+                            if (d >= 16) invalid();
+                            cp = cp * 16 + d;
+                            if (cp > 0x10FFFF) invalid();
+                        }
+                        if (i == body.size() || digits == 0) invalid();
+                        i++;
+                    } else {
+                        cp = hex(i, 4);
+                        // high surrogate followed by \u low surrogate is one code point. The next
+                        // escape is only looked at here, not read: if it is not 4 hex digits of a
+                        // low surrogate ("\u{41}", "\u0041") the next round decodes it as usual.
+                        if (cp >= 0xD800 && cp <= 0xDBFF && i + 6 <= body.size() && body[i] == '\\' && body[i + 1] == 'u') {
+                            size_t j = i + 2;
+                            uint32_t low = 0;
+                            for (; j < i + 6 && digitValue(body[j]) < 16; j++) low = low * 16 + digitValue(body[j]);
+                            if (j == i + 6 && low >= 0xDC00 && low <= 0xDFFF) {
+                                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                                i = j;
+                            }
+                        }
+                    }
+                    appendUtf8(out, cp);
+                    break;
+                }
+                case '0': case '1': case '2': case '3':
+                case '4': case '5': case '6': case '7': {
+                    // legacy octal: up to 3 digits, but not over \377
+                    uint32_t value = c - '0';
+                    size_t maxDigits = c <= '3' ? 3 : 2;
+                    for (size_t k = 1; k < maxDigits && i < body.size() && body[i] >= '0' && body[i] <= '7'; k++, i++) {
+                        value = value * 8 + (body[i] - '0');
+                    }
+                    appendUtf8(out, value);
+                    break;
+                }
+                default:
+                    // U+2028 and U+2029 after a backslash are line continuations too
+                    if (c == '\xE2' && i + 1 < body.size() && body[i] == '\x80' && (body[i + 1] == '\xA8' || body[i + 1] == '\xA9')) {
+                        i += 2;
+                    } else {
+                        // any other char stands for itself (\' \" \\ and also \a or \é)
+                        *out++ = c;
+                    }
+                    break;
+            }
+        }
+        strings.commit(out);
+        return std::string_view(begin, out - begin);
+    }
+
     
      // This function reads comments (single-line // or multi-line /* */) using a DFA.
     // States: START (we saw '/'), SLASH (decide / or *), SINGLE (in // comment), MULTI (in /* comment), STAR (saw '*' inside multi), ACCEPT (end).
-    Token readCommentFA(bool trace) {
+    Token readCommentFA() {
         enum class State { START, SLASH, SINGLE, MULTI, STAR, ACCEPT };
         State state = State::START;
-        std::string buf;
         int startCol = col;
+        size_t start = pos;
 
         // We know input[pos] == '/', so add and move to SLASH state.
-        buf += input[pos];
         pos++;
         col++;
         state = State::SLASH;
@@ -376,14 +2536,12 @@ private:
                 case State::SLASH:
                     if (c == '/') {
                         // This is "//" start. Add and go to SINGLE state.
-                        buf += c;
                         pos++;
                         col++;
                         state = State::SINGLE;
                     }
                     else if (c == '*') {
                         // This is "/*" start. Add and go to MULTI state.
-                        buf += c;
                         pos++;
                         col++;
                         state = State::MULTI;
@@ -403,7 +2561,6 @@ private:
                         // Do not include newline in comment content.
                         state = State::ACCEPT;
                     } else {
-                        buf += c;
                         pos++;
                         col++;
                     }
@@ -412,7 +2569,6 @@ private:
                 case State::MULTI:
                     if (c == '*') {
                         // Saw '*', might be end "*/". Go to STAR state.
-                        buf += c;
                         pos++;
                         col++;
                         state = State::STAR;
@@ -420,12 +2576,10 @@ private:
                     else {
                         // Normal character inside multi-line. Track newlines.
                         if (c == '\n') {
-                            buf += c;
                             pos++;
                             line++;
                             col = 1;
                         } else {
-                            buf += c;
                             pos++;
                             col++;
                         }
@@ -436,20 +2590,17 @@ private:
                 case State::STAR:
                     if (c == '/') {
                         // Found closing "*/". Add and accept.
-                        buf += c;
                         pos++;
                         col++;
                         state = State::ACCEPT;
                     }
                     else if (c == '*') {
                         // Another '*' still inside. Stay in STAR.
-                        buf += c;
                         pos++;
                         col++;
                     }
                     else {
                         // Not closing, go back to MULTI.
-                        buf += c;
                         if (c == '\n') {
                             line++;
                             col = 1;
@@ -475,225 +2626,967 @@ private:
                 ", col " + std::to_string(startCol)
             );
         }
-        Token t = { TokenType::Comment, buf, line, startCol };
-        if (trace) printToken(t);
+        // scan() gives it to the observer, unless the comment is only trivia.
+        Token t = { TokenType::Comment, input.substr(start, pos - start), line, startCol, start };
+        return t;
+    }
+    // This function reads operators and punctuators (=, ===, >>>=, ?., ..., =>, {, ; and so on).
+    // It walks punctuatorTrie one character at a time and remembers the last place where a
+    // punctuator ended, so it always takes the longest one ("a >>>= b" gives ">>>=").
+    // The only special case is "?." before a digit: "a?.5:1" is "?" and ".5", not "?.".
+    Token readOperatorFA() {
+        int startCol = col;
+        size_t start = pos;
+        size_t node = 0, len = 0, acceptNode = 0, acceptLen = 0;
+        while (start + len < input.size()) {
+            uint8_t cls = punctuatorTrie.charClass[static_cast<unsigned char>(input[start + len])];
+            node = punctuatorTrie.next[node][cls];
+            if (cls == 0 || node == 0) break;
+            ++len;
+            if (punctuatorTrie.accept[node]) {
+                acceptNode = node;
+                acceptLen = len;
+            }
+        }
+        if (punctuatorTrie.type[acceptNode] == TokenType::Punctuation
+            && punctuatorTrie.sub[acceptNode] == static_cast<uint8_t>(Punc::OptionalChain)
+            && start + 2 < input.size() && isDecimalDigit(input[start + 2])) {
+            acceptNode = punctuatorTrie.next[0][punctuatorTrie.charClass[static_cast<unsigned char>('?')]];
+            acceptLen = 1;
+        }
+        pos += acceptLen;
+        col += static_cast<int>(acceptLen);
+        Token t = { punctuatorTrie.type[acceptNode], input.substr(start, acceptLen), line, startCol, start };
+        t.sub = punctuatorTrie.sub[acceptNode];
+        // Inside a ${ substitution count the braces, so the right '}' ends it.
+        if (!templateBraces.empty()) {
+            if (t.punc() == Punc::LBrace) ++templateBraces.back();
+            else if (t.punc() == Punc::RBrace) --templateBraces.back();
+        }
+        emit(t);
         return t;
     }
-    // In this function we read JavaScript operators like =, ==, ===, !=, !==, <, <<, <=, >, >>, >>>, and so on.
-    // we use peek to see the next character without moving pos immediately.
-    // If programm find a multi-character operator (for example "==" or "!=="), advance() adds each character to buf one by one.
-Token readOperatorFA(bool trace) {
-    enum class State {
-        START,      // before reading any operator
-        GOT_EQ,     // we saw '='
-        GOT_BANG,   // we saw '!'
-        GOT_LT,     // we saw '<'
-        GOT_GT,     // we saw '>'
-        GOT_AND,    // we saw '&'
-        GOT_OR,     // we saw '|'
-        AFTER_GT1,  // we saw ">>"
-        AFTER_GT2,  // we saw ">>>"
-        ACCEPT      // finished reading the operator
-    };
 
-    State state = State::START;
-    std::string buf;
-    int startCol = col;
+    // True if c can start an operator or punctuator. Every character of the table is the
+    // first character of some entry, so the class table answers it without a search.
+    static bool isPunctuatorStart(char c) {
+        return punctuatorTrie.charClass[static_cast<unsigned char>(c)] != 0;
+    }
+};
 
-    auto peek = [&](int offset = 0) -> char {
-        // return character at current position + offset, or '\0' if out of range
-        return (pos + offset < input.size()) ? input[pos + offset] : '\0';
-    };
-    auto advance = [&]() {
-        // add current char to buffer, move position and column forward
-        buf += input[pos];
-        pos++;
-        col++;
+// TokenStream is the input range returned by BasicLexer::tokens(). It keeps the current
+// token and pulls the next one from the lexer when it is needed. Like every input range it can be
+// walked only once, and an iterator is valid only until it is incremented.
+template <typename LexerT>
+class TokenStream {
+    LexerT* lexer;
+    Token current{};
+    bool pending = true, ended = false;
+
+public:
+    class iterator {
+        TokenStream* stream = nullptr;
+
+    public:
+        using value_type = Token;
+        using difference_type = std::ptrdiff_t;
+        using iterator_concept = std::input_iterator_tag;
+
+        iterator() = default;
+        explicit iterator(TokenStream* stream) : stream(stream) {}
+
+        const Token& operator*() const { return stream->fill(); }
+        const Token* operator->() const { return &stream->fill(); }
+
+        iterator& operator++() {
+            stream->advance();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const {
+            stream->fill();
+            return stream->ended;
+        }
     };
 
-    while (pos < input.size()) {
-        char c = peek();
-        switch (state) {
-            case State::START:
-                // Here we decide which operator we begin with
-                if (c == '=') {
-                    advance();       // take '='
-                    state = State::GOT_EQ;
-                }
-                else if (c == '!') {
-                    advance();       // take '!'
-                    state = State::GOT_BANG;
-                }
-                else if (c == '<') {
-                    advance();       // take '<'
-                    state = State::GOT_LT;
-                }
-                else if (c == '>') {
-                    advance();       // take '>'
-                    state = State::GOT_GT;
-                }
-                else if (c == '&') {
-                    advance();       // take '&'
-                    state = State::GOT_AND;
-                }
-                else if (c == '|') {
-                    advance();       // take '|'
-                    state = State::GOT_OR;
-                }
-                else if (std::string("+-*/%^").find(c) != std::string::npos) {
-                    // Single-character operators: +, -, *, /, %, ^
-                    advance();
-                    state = State::ACCEPT;
-                }
-                else {
-                    // If we did not match any operator start, throw error
-                    throw std::runtime_error(
-                        "Unknown operator at line " + std::to_string(line) +
-                        ", column " + std::to_string(col)
-                    );
-                }
-                break;
+    explicit TokenStream(LexerT& lexer) : lexer(&lexer) {}
 
-            case State::GOT_EQ:
-                // After seeing '=', check if next is '=' or '==='
-                if (peek() == '=') {
-                    advance();    // take second '='
-                    if (peek() == '=') {
-                        advance(); // take third '=' for '==='
-                    }
-                }
-                state = State::ACCEPT; // now operator is complete
-                break;
+    iterator begin() { return iterator(this); }
+    std::default_sentinel_t end() const { return {}; }
 
-            case State::GOT_BANG:
-                // After seeing '!', check if next is '!=' or '!=='
-                if (peek() == '=') {
-                    advance();    // take '=' for '!='
-                    if (peek() == '=') {
-                        advance(); // take second '=' for '!=='
-                    }
-                }
-                state = State::ACCEPT; // operator is complete
-                break;
+private:
+    // Tokens are read lazily: ++ only marks that the next token is wanted, and it is read
+    // when the iterator is used. So views::take(n) stops after exactly n tokens.
+    // The step after EndOfFile ends the range.
+    void advance() {
+        fill();
+        if (current.type == TokenType::EndOfFile) ended = true;
+        else pending = true;
+    }
 
-            case State::GOT_LT:
-                // After seeing '<', check if next is '<=' or '<<'
-                if (peek() == '<') {
-                    advance();    // take second '<' for '<<'
-                }
-                else if (peek() == '=') {
-                    advance();    // take '=' for '<='
-                }
-                state = State::ACCEPT; // operator is complete
-                break;
+    const Token& fill() {
+        if (pending && !ended) {
+            current = lexer->next();
+            pending = false;
+        }
+        return current;
+    }
+};
 
-            case State::GOT_GT:
-                // After seeing '>', check if next is '>>', '>>>' or '>='
-                if (peek() == '>') {
-                    advance();    // take second '>' for '>>'
-                    state = State::AFTER_GT1;
-                }
-                else if (peek() == '=') {
-                    advance();    // take '=' for '>='
-                    state = State::ACCEPT;
-                }
-                else {
-                    state = State::ACCEPT; // just '>' is done
-                }
-                break;
+// TokenBuffer gives a parser k-token lookahead on top of the lexer without a token vector.
+// It is a ring of Capacity tokens that is refilled from lexer.next() when needed, so the
+// memory is the same for any input size.
+//   peek(k)   - the k-th token after the current one (k < Capacity), nothing is consumed
+//   next()    - returns the current token and moves on
+//   mark()    - remembers the current position, rewind(m) goes back to it (for backtracking,
+//               for example to try an arrow function and go back if it is not one),
+//               release(m) forgets it. Marks must be released or rewound in reverse order.
+// While a mark is active, its token and everything after it stay in the ring. If a parser
+// goes more than Capacity tokens past its oldest mark, that is an error, not a reallocation.
+template <typename LexerT, size_t Capacity = 16>
+class TokenBuffer {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
 
-            case State::AFTER_GT1:
-                // We have '>>'; now check if next is '>>>' or '>>='
-                if (peek() == '>') {
-                    advance();    // take third '>' for '>>>'
-                    state = State::AFTER_GT2;
-                }
-                else if (peek() == '=') {
-                    advance();    // take '=' for '>>='
-                    state = State::ACCEPT;
-                }
-                else {
-                    state = State::ACCEPT; // just '>>' is done
-                }
-                break;
+    LexerT* lexer;
+    Token ring[Capacity] = {};
+    size_t head = 0;     // absolute index of the current token
+    size_t tail = 0;     // absolute index of the next token to read from the lexer
+    size_t pinned = 0;   // absolute index of the oldest active mark
+    size_t marks = 0;    // number of active marks
 
-            case State::AFTER_GT2:
-                // We have '>>>'; now check if next is '>>>='
-                if (peek() == '=') {
-                    advance();    // take '=' for '>>>='
-                }
-                state = State::ACCEPT; // done reading
-                break;
+public:
+    using Mark = size_t;
 
-            case State::GOT_AND:
-                // After seeing '&', check if next is '&&'
-                if (peek() == '&') {
-                    advance();    // take second '&' for '&&'
-                }
-                state = State::ACCEPT; // done
-                break;
+    explicit TokenBuffer(LexerT& lexer) : lexer(&lexer) {}
 
-            case State::GOT_OR:
-                // After seeing '|', check if next is '||'
-                if (peek() == '|') {
-                    advance();    // take second '|' for '||'
-                }
-                state = State::ACCEPT; // done
-                break;
+    const Token& peek(size_t k = 0) {
+        if (k >= Capacity) throw std::runtime_error("Lookahead of " + std::to_string(k) + " tokens is too far");
+        while (tail <= head + k) fill();
+        return ring[(head + k) & (Capacity - 1)];
+    }
+
+    // After EndOfFile the lexer keeps returning EndOfFile, so next() never runs out.
+    Token next() {
+        Token t = peek();
+        ++head;
+        return t;
+    }
+
+    Mark mark() {
+        if (marks++ == 0) pinned = head;
+        return head;
+    }
+
+    void rewind(Mark m) {
+        head = m;
+        release(m);
+    }
+
+    void release(Mark m) {
+        if (marks == 0 || m < pinned) throw std::runtime_error("Release of a mark that is not active");
+        --marks;
+    }
+
+private:
+    void fill() {
+        size_t oldest = marks ? pinned : head;
+        if (tail - oldest >= Capacity)
+            throw std::runtime_error("Token buffer overflow: more than " + std::to_string(Capacity) + " tokens after a mark");
+        ring[tail & (Capacity - 1)] = lexer->next();
+        ++tail;
+    }
+};
+
+using Lexer = BasicLexer<NullObserver>;
+using TraceLexer = BasicLexer<TraceObserver>;
+
+// Every thread gets one Lexer that lives as long as the thread. Services that lex many
+// small inputs per thread can call threadLexer().lex(src) and after warm-up nothing is
+// allocated: the config is shared and the token vector keeps its capacity.
+inline Lexer& threadLexer() {
+    thread_local Lexer lexer;
+    return lexer;
+}
+using JsonLexer = BasicLexer<JsonObserver>;
+
+static_assert(std::ranges::input_range<TokenStream<Lexer>>, "TokenStream must be a C++20 input range");
+
+// BatchResult holds the tokens of many snippets in one shared vector (the arena).
+// Snippet i owns tokens[offsets[i], offsets[i + 1]), ending with its own EndOfFile token.
+// If snippet i failed, errors[i] has the message and its range is empty.
+struct BatchResult {
+    std::vector<Token> tokens;
+    std::vector<size_t> offsets;
+    std::vector<std::string> errors;
+    // Decoded strings with escapes (LexerConfig::decodeStrings), one arena per worker.
+    std::vector<std::unique_ptr<StringArena>> arenas;
+
+    size_t size() const { return errors.size(); }
+    bool ok(size_t i) const { return errors[i].empty(); }
+    std::span<const Token> snippet(size_t i) const {
+        return std::span<const Token>(tokens.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+};
+
+// Lexes snippets[begin, end) one after another with one reused lexer, appending to result.
+inline void tokenizeBatchRange(const std::vector<std::string_view>& snippets, size_t begin, size_t end,
+                               const LexerConfig& config, SharedInterner* shared, BatchResult& result) {
+    Lexer lexer(std::string_view(), config);
+    if (config.decodeStrings) {
+        result.arenas.push_back(std::make_unique<StringArena>());
+        lexer.setArena(result.arenas.back().get());
+    }
+    std::optional<SymbolTable> symbols;
+    if (shared) {
+        symbols.emplace(shared);
+        lexer.setSymbols(&*symbols);
+    }
+    VectorSink sink{ &result.tokens };
+    result.offsets.reserve(result.offsets.size() + (end - begin));
+    result.errors.reserve(result.errors.size() + (end - begin));
+    for (size_t i = begin; i < end; ++i) {
+        size_t start = result.tokens.size();
+        try {
+            lexer.reset(snippets[i]);
+            lexer.tokenize(sink);
+            result.errors.emplace_back();
+        } catch (const std::runtime_error& err) {
+            result.tokens.resize(start);
+            result.errors.emplace_back(err.what());
+        }
+        result.offsets.push_back(result.tokens.size());
+    }
+}
+
+// Batch API for many tiny inputs (event handlers, config expressions, REPL lines).
+// All snippets are lexed by one lexer that is only reset() between them, into one token
+// vector, so per snippet there is no lexer construction, no input copy and no new vector.
+// An error in one snippet is stored in errors and does not stop the others.
+// With threads > 1 the snippets are split into contiguous parts, every thread fills
+// its own result and at the end the parts are appended to the first one in order.
+// With a SharedInterner every worker interns names through its own SymbolTable in front of
+// it, so symbol ids in the result are the same for all snippets and all threads.
+// Snippets must stay alive while the result is used, because lexemes point into them.
+inline BatchResult tokenizeBatch(const std::vector<std::string_view>& snippets, unsigned threads = 1,
+                                 const LexerConfig& config = LexerConfig::defaults(),
+                                 SharedInterner* shared = nullptr) {
+    size_t n = snippets.size();
+    // A thread needs a few hundred snippets to be worth starting.
+    size_t parts = std::max<size_t>(1, std::min<size_t>(threads, n / 256));
+    std::vector<BatchResult> results(parts);
+    results[0].offsets.push_back(0);
+    if (parts == 1) {
+        tokenizeBatchRange(snippets, 0, n, config, shared, results[0]);
+        return std::move(results[0]);
+    }
+    std::vector<std::thread> workers;
+    for (size_t p = 0; p < parts; ++p) {
+        workers.emplace_back([&, p] {
+            tokenizeBatchRange(snippets, n * p / parts, n * (p + 1) / parts, config, shared, results[p]);
+        });
+    }
+    for (std::thread& w : workers) w.join();
+
+    BatchResult& all = results[0];
+    size_t totalTokens = 0;
+    for (const BatchResult& r : results) totalTokens += r.tokens.size();
+    all.tokens.reserve(totalTokens);
+    all.offsets.reserve(n + 1);
+    all.errors.reserve(n);
+    for (size_t p = 1; p < parts; ++p) {
+        size_t base = all.tokens.size();
+        all.tokens.insert(all.tokens.end(), results[p].tokens.begin(), results[p].tokens.end());
+        for (size_t offset : results[p].offsets) all.offsets.push_back(base + offset);
+        std::move(results[p].errors.begin(), results[p].errors.end(), std::back_inserter(all.errors));
+        std::move(results[p].arenas.begin(), results[p].arenas.end(), std::back_inserter(all.arenas));
+    }
+    return std::move(all);
+}
+
+// Binary token files (.jstk) let other tools load the tokens again without lexing.
+// The file is: TokenFileHeader, then tokenCount TokenRecord entries, then (optional)
+// a lexeme pool, which is simply a copy of the source text. Lexeme i is
+// pool[offset, offset + length), so no per-token strings are stored at all.
+// All fields are fixed size in host byte order, so the reader just maps the file into
+// memory and uses the records in place, there is no parsing step.
+// If the layout ever changes, tokenFileVersion must be increased.
+constexpr char tokenFileMagic[4] = { 'J', 'S', 'T', 'K' };
+constexpr uint32_t tokenFileVersion = 5;
+constexpr uint32_t tokenFileHasPool = 1;
+
+// Version of what the lexer produces, not of the file layout. Cached tokens are only
+// valid for the lexer that made them, so increase this whenever tokenization changes.
+// It was 1 and got increased for the punctuator trie, numeric literals, templates,
+// regular expressions, Unicode identifiers and token flags, then for regular expressions
+// after typeof, in, new and such.
+constexpr uint32_t lexerVersion = 8;
+
+struct TokenFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;   // sizeof(TokenRecord), checked by the reader
+    uint32_t flags;        // tokenFileHasPool if the lexeme pool is present
+    uint64_t tokenCount;
+    uint64_t poolSize;
+};
+
+struct TokenRecord {
+    uint32_t offset, length;
+    uint32_t line, column;
+    uint8_t kind;          // TokenType
+    uint8_t sub;           // Op or Punc (since version 2), TemplatePart (since version 3), RegExpFlag bits (since version 4)
+    uint8_t flags;         // TokenFlag bits (since version 5)
+    uint8_t reserved8;
+};
 
-            case State::ACCEPT:
-                // When ACCEPT, break out of loop
-                goto done;
+static_assert(sizeof(TokenFileHeader) == 32, "TokenFileHeader layout is part of the file format");
+static_assert(sizeof(TokenRecord) == 20, "TokenRecord layout is part of the file format");
+
+// Writes tokens to a .jstk file in one sequential pass through a TokenWriter buffer.
+// If source is not empty it is stored as the lexeme pool.
+// Tokens is any sized range of Token, for example std::vector<Token> or TokenChunks.
+// Offsets and lengths are 32 bit in the file, with or without pool, so a token that ends
+// past 4 GB can not be stored. Then the file is removed and an error is thrown.
+template <typename Tokens>
+void writeTokenFile(const std::string& path, const Tokens& tokens, std::string_view source = {}) {
+    if (source.size() > UINT32_MAX)
+        throw std::runtime_error("Source is too big for a token file: " + path);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error("Cannot create file " + path);
+    try {
+        TokenWriter out(fd);
+        TokenFileHeader header = {};
+        std::memcpy(header.magic, tokenFileMagic, sizeof header.magic);
+        header.version = tokenFileVersion;
+        header.recordSize = sizeof(TokenRecord);
+        header.flags = source.empty() ? 0 : tokenFileHasPool;
+        header.tokenCount = tokens.size();
+        header.poolSize = source.size();
+        out.write(std::string_view(reinterpret_cast<const char*>(&header), sizeof header));
+        for (const Token& t : tokens) {
+            if (t.offset + t.lexeme.size() > UINT32_MAX)
+                throw std::runtime_error("Source is too big for a token file: " + path);
+            TokenRecord r = {};
+            r.offset = static_cast<uint32_t>(t.offset);
+            r.length = static_cast<uint32_t>(t.lexeme.size());
+            r.line = static_cast<uint32_t>(t.line);
+            r.column = static_cast<uint32_t>(t.column);
+            r.kind = static_cast<uint8_t>(t.type);
+            r.sub = t.sub;
+            r.flags = t.flags;
+            out.write(std::string_view(reinterpret_cast<const char*>(&r), sizeof r));
         }
+        out.write(source);
+        out.flush();
+    } catch (...) {
+        ::close(fd);
+        ::unlink(path.c_str());
+        throw;
     }
+    if (::close(fd) != 0) throw std::runtime_error("Failed to write token file " + path);
+}
 
-done:
-    // Build the token with collected characters
-    Token t = { TokenType::Operator, buf, line, startCol };
-    if (trace) printToken(t);
-    return t;
+// TokenType of a record. The kind comes from a file, so a broken file could have any value
+// there, and tokenTag() would read past its table.
+inline TokenType recordType(const TokenRecord& r) {
+    if (r.kind > static_cast<uint8_t>(TokenType::EndOfFile))
+        throw std::runtime_error("Bad token kind " + std::to_string(r.kind) + " in token file");
+    return static_cast<TokenType>(r.kind);
 }
 
+// TokenFileView opens a .jstk file with mmap and gives access to the records in place.
+// Opening only checks the header, so it costs the same for a small or a 500 MB file,
+// and pages are loaded by the OS only when records are really used.
+class TokenFileView {
+    const char* data = nullptr;
+    size_t mappedSize = 0;
+    const TokenFileHeader* header = nullptr;
+    const TokenRecord* recs = nullptr;
+    const char* pool = nullptr;
 
-    Token readPunctuation(bool trace) {
-        Token t = { TokenType::Punctuation, std::string(1, input[pos]), line, col };
-        pos++; col++;
-        return t;
+public:
+    TokenFileView() = default;
+
+    explicit TokenFileView(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open file " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TokenFileHeader)) {
+            ::close(fd);
+            throw std::runtime_error("Not a token file: " + path);
+        }
+        mappedSize = static_cast<size_t>(st.st_size);
+        void* p = ::mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("Cannot map file " + path);
+        data = static_cast<const char*>(p);
+        header = reinterpret_cast<const TokenFileHeader*>(data);
+        // Check that the header is ours and that the sizes in it fit in the file.
+        bool ok = std::memcmp(header->magic, tokenFileMagic, sizeof header->magic) == 0
+            && header->version == tokenFileVersion
+            && header->recordSize == sizeof(TokenRecord)
+            && header->tokenCount <= (mappedSize - sizeof(TokenFileHeader)) / sizeof(TokenRecord)
+            && header->poolSize == mappedSize - sizeof(TokenFileHeader) - header->tokenCount * sizeof(TokenRecord);
+        if (!ok) {
+            unmap();
+            throw std::runtime_error("Not a token file or wrong version: " + path);
+        }
+        recs = reinterpret_cast<const TokenRecord*>(data + sizeof(TokenFileHeader));
+        pool = reinterpret_cast<const char*>(recs + header->tokenCount);
     }
-    // These helper functions return true if the character is in the set of operators or punctuation.
-    // Programm store those characters in strings so I can quickly check membership with find().
-    // This lets choose the correct token-reading function quickly.
-    bool isOperatorChar(char c) {
-        return std::string("+-*/=<>!&|^%").find(c) != std::string::npos;
+
+    TokenFileView(TokenFileView&& other) noexcept { *this = std::move(other); }
+
+    TokenFileView& operator=(TokenFileView&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            data = std::exchange(other.data, nullptr);
+            mappedSize = std::exchange(other.mappedSize, 0);
+            header = std::exchange(other.header, nullptr);
+            recs = std::exchange(other.recs, nullptr);
+            pool = std::exchange(other.pool, nullptr);
+        }
+        return *this;
     }
 
-    bool isPunctuation(char c) {
-        return std::string("(){}[],;.").find(c) != std::string::npos;
+    ~TokenFileView() { unmap(); }
+
+    size_t size() const { return header ? header->tokenCount : 0; }
+    const TokenRecord& operator[](size_t i) const { return recs[i]; }
+    const TokenRecord* begin() const { return recs; }
+    const TokenRecord* end() const { return recs + size(); }
+
+    TokenType type(size_t i) const { return recordType(recs[i]); }
+    bool hasLexemes() const { return header && (header->flags & tokenFileHasPool); }
+    std::string_view source() const { return hasLexemes() ? std::string_view(pool, header->poolSize) : std::string_view(); }
+
+    // Returns the text of token i from the pool, or an empty view if the file has no pool.
+    std::string_view lexeme(size_t i) const {
+        if (!hasLexemes() || recs[i].offset + uint64_t(recs[i].length) > header->poolSize) return {};
+        return std::string_view(pool + recs[i].offset, recs[i].length);
     }
-    // This helper function is for trace mode. If trace=true, I print each token in the format [line:column] TYPE 'lexeme'.
-        void printToken(const Token& t) {
-        std::string type;
-        switch (t.type) {
-            case TokenType::Keyword: type = "KW"; break;
-            case TokenType::Identifier: type = "ID"; break;
-            case TokenType::Number: type = "NUM"; break;
-            case TokenType::Operator: type = "OP"; break;
-            case TokenType::String: type = "STR"; break;
-            case TokenType::Comment: type = "CMT"; break;
-            case TokenType::Punctuation: type = "PUN"; break;
-            case TokenType::EndOfFile: type = "EOF"; break;
-            default: type = "UNK";
+
+private:
+    void unmap() {
+        if (data) ::munmap(const_cast<char*>(data), mappedSize);
+        data = nullptr;
+        header = nullptr;
+        recs = nullptr;
+        pool = nullptr;
+        mappedSize = 0;
+    }
+};
+
+// hash64 is xxHash64 (by Yann Collet), a fast non-cryptographic hash. It reads 32 bytes
+// per round in four independent lanes, so it runs at memory speed on big inputs.
+// I use it to find the token cache file of an input by its content.
+inline uint64_t hash64(std::string_view data, uint64_t seed = 0) {
+    constexpr uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL, p3 = 0x165667B19E3779F9ULL,
+                       p4 = 0x85EBCA77C2B2AE63ULL, p5 = 0x27D4EB2F165667C5ULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; };
+    auto merge = [&](uint64_t acc, uint64_t lane) { return (acc ^ round(0, lane)) * p1 + p4; };
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t h;
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + p1 + p2, v2 = seed + p2, v3 = seed, v4 = seed - p1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + p5;
+    }
+    h += data.size();
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+    if (p + 4 <= end) { h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3; p += 4; }
+    for (; p < end; ++p) h = rotl(h ^ (static_cast<unsigned char>(*p) * p5), 11) * p1;
+    h ^= h >> 33; h *= p2;
+    h ^= h >> 29; h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+// TokenCache is an on-disk store of token files, keyed by the hash of the input bytes,
+// so unchanged (or copied) sources are not lexed again. Every entry is a .jstk file
+// without pool (the caller has the source anyway) named <hash>-<size>-v<lexerVersion>.jstk,
+// so entries of an older lexer are never used and just age out.
+// Several processes and threads can use the same directory:
+// - a new entry is written to a temporary file and then renamed, so readers never see half a file;
+// - two writers of the same entry just write the same content;
+// - an entry can be deleted while somebody has it mapped, the mapping stays valid.
+// Every hit updates the file time, so the oldest time means least recently used. When the
+// directory grows over maxBytes, the oldest entries are removed until it is at 3/4 of it.
+class TokenCache {
+    std::string dir;
+    uint64_t maxBytes;
+    // Bytes stored since the last evict(). Threads of a batch share one cache, so it is atomic.
+    std::atomic<uint64_t> writtenSinceEvict{0};
+    // Set by the first store(), which always runs evict().
+    std::atomic<bool> storedBefore{false};
+    std::atomic<uint64_t> tempCounter{0};
+
+public:
+    explicit TokenCache(std::string dir, uint64_t maxBytes = uint64_t(1) << 30)
+        : dir(std::move(dir)), maxBytes(maxBytes) {
+        std::error_code ec;
+        std::filesystem::create_directories(this->dir, ec);
+        if (ec) throw std::runtime_error("Cannot create cache directory " + this->dir);
+    }
+
+    std::string pathFor(std::string_view input) const {
+        char name[64];
+        int n = std::snprintf(name, sizeof name, "/%016llx-%llu-v%u.jstk",
+                              static_cast<unsigned long long>(hash64(input)),
+                              static_cast<unsigned long long>(input.size()), lexerVersion);
+        return dir + std::string(name, n);
+    }
+
+    // Returns the cached tokens of input, or nothing if they are not in the cache.
+    std::optional<TokenFileView> find(std::string_view input) {
+        std::string path = pathFor(input);
+        try {
+            TokenFileView view(path);
+            // The last token is EOF at the end of the input; anything else is a broken entry.
+            if (view.size() == 0 || view[view.size() - 1].offset != input.size()) return std::nullopt;
+            ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+            return view;
+        } catch (const std::runtime_error&) {
+            return std::nullopt;
+        }
+    }
+
+    // Stores tokens of input and returns the new entry. It is mapped before the rename,
+    // so eviction by this or another process can not take it away from us.
+    TokenFileView store(std::string_view input, const std::vector<Token>& tokens) {
+        std::string path = pathFor(input);
+        std::string temp = dir + "/.tmp-" + std::to_string(::getpid()) + "-"
+            + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "-"
+            + std::to_string(tempCounter++);
+        TokenFileView view;
+        try {
+            writeTokenFile(temp, tokens);
+            view = TokenFileView(temp);
+        } catch (...) {
+            ::unlink(temp.c_str());
+            throw;
+        }
+        if (::rename(temp.c_str(), path.c_str()) != 0) {
+            ::unlink(temp.c_str());
+            throw std::runtime_error("Cannot store cache entry " + path);
+        }
+        // Scanning the directory is not free, so I only do it after writing 1/8 of the limit.
+        // The thread that takes the counter back to 0 does it, the others go on.
+        // A process that stores only a few entries would never get there (a CI job that runs
+        // the tool once per file), so the first store of every TokenCache scans too. This
+        // way the limit holds for all processes together.
+        uint64_t size = sizeof(TokenFileHeader) + tokens.size() * sizeof(TokenRecord);
+        if (!storedBefore.exchange(true)) evict();
+        else if (writtenSinceEvict.fetch_add(size) + size > maxBytes / 8 && writtenSinceEvict.exchange(0) != 0) evict();
+        return view;
+    }
+
+    // Returns the tokens of input from the cache. On a miss the input is lexed and stored first.
+    // Lexer errors are thrown as usual and nothing is stored for such input.
+    TokenFileView get(std::string_view input) {
+        if (auto view = find(input)) return std::move(*view);
+        return store(input, threadLexer().lex(input));
+    }
+
+    // Same as get(), but returns normal Token objects. Lexemes point into input.
+    std::vector<Token> tokenize(std::string_view input) {
+        TokenFileView view = get(input);
+        std::vector<Token> tokens;
+        tokens.reserve(view.size());
+        for (const TokenRecord& r : view) {
+            tokens.push_back({ recordType(r), input.substr(r.offset, r.length),
+                               static_cast<int>(r.line), static_cast<int>(r.column), r.offset, 0, r.sub, r.flags });
+        }
+        return tokens;
+    }
+
+    // Removes least recently used entries while the directory is bigger than maxBytes.
+    // Only one process evicts at a time, the others skip it (flock on .evict.lock).
+    void evict() {
+        std::string lockPath = dir + "/.evict.lock";
+        int lockFd = ::open(lockPath.c_str(), O_RDWR | O_CREAT, 0644);
+        if (lockFd < 0) return;
+        if (::flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+            ::close(lockFd);
+            return;
+        }
+        struct Entry { std::filesystem::path path; std::filesystem::file_time_type time; uint64_t size; };
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (const auto& e : std::filesystem::directory_iterator(dir, ec)) {
+            if (e.path().extension() != ".jstk") continue;
+            std::error_code fileEc;
+            uint64_t size = e.file_size(fileEc);
+            auto time = e.last_write_time(fileEc);
+            if (fileEc) continue;
+            entries.push_back({ e.path(), time, size });
+            total += size;
+        }
+        if (total > maxBytes) {
+            std::sort(entries.begin(), entries.end(),
+                      [](const Entry& a, const Entry& b) { return a.time < b.time; });
+            for (const Entry& e : entries) {
+                if (total <= maxBytes / 4 * 3) break;
+                std::error_code fileEc;
+                if (std::filesystem::remove(e.path, fileEc)) total -= e.size;
+            }
+        }
+        ::flock(lockFd, LOCK_UN);
+        ::close(lockFd);
+    }
+};
+
+// Encodings of source files. The lexer itself works on UTF-8 (ASCII is UTF-8 too), other
+// encodings are converted when the file is read.
+enum class SourceEncoding { Utf8, Utf16LE, Utf16BE, Latin1 };
+
+// Finds the encoding from a byte order mark at the start of data, without one it is fallback.
+// bomLength is set to the size of the mark, the mark is not part of the text.
+inline SourceEncoding detectEncoding(std::string_view data, SourceEncoding fallback, size_t& bomLength) {
+    bomLength = 0;
+    if (data.size() >= 3 && data.substr(0, 3) == "\xEF\xBB\xBF") {
+        bomLength = 3;
+        return SourceEncoding::Utf8;
+    }
+    if (data.size() >= 2 && data[0] == '\xFF' && data[1] == '\xFE') {
+        bomLength = 2;
+        return SourceEncoding::Utf16LE;
+    }
+    if (data.size() >= 2 && data[0] == '\xFE' && data[1] == '\xFF') {
+        bomLength = 2;
+        return SourceEncoding::Utf16BE;
+    }
+    return fallback;
+}
+
+// Converts UTF-16 or Latin-1 to UTF-8 block by block. A block can end anywhere, also in the
+// middle of a code unit or between the two halves of a surrogate pair, the rest is kept for
+// the next feed(). Broken input (a lone surrogate, an odd last byte) becomes U+FFFD, so the
+// output is always valid UTF-8.
+// ASCII is the common case: 8 input bytes are checked at once (SWAR) and if all of them are
+// ASCII, they are packed without looking at single characters.
+class Utf8Transcoder {
+    SourceEncoding encoding;
+    uint32_t highSurrogate = 0;
+    bool hasOddByte = false;
+    unsigned char oddByte = 0;
+
+public:
+    explicit Utf8Transcoder(SourceEncoding encoding) : encoding(encoding) {}
+
+    // Appends the UTF-8 text of block to out.
+    void feed(std::string_view block, std::string& out) {
+        if (encoding == SourceEncoding::Utf8) {
+            out.append(block);
+            return;
+        }
+        size_t old = out.size();
+        // Worst case: a Latin-1 byte is 2 UTF-8 bytes, a UTF-16 unit 3 bytes, plus a U+FFFD.
+        out.resize(old + (encoding == SourceEncoding::Latin1 ? block.size() * 2 : (block.size() / 2 + 1) * 3 + 3));
+        char* p = out.data() + old;
+        if (encoding == SourceEncoding::Latin1) latin1(block, p);
+        else utf16(block, p);
+        out.resize(p - out.data());
+    }
+
+    // Call after the last block: a pending half surrogate or odd byte becomes U+FFFD.
+    void finish(std::string& out) {
+        if (highSurrogate || hasOddByte) {
+            char buf[4];
+            char* p = buf;
+            appendUtf8(p, 0xFFFD);
+            out.append(buf, p - buf);
+        }
+        highSurrogate = 0;
+        hasOddByte = false;
+    }
+
+private:
+    void latin1(std::string_view in, char*& p) {
+        size_t i = 0;
+        while (i < in.size()) {
+            if constexpr (std::endian::native == std::endian::little) {
+                uint64_t x;
+                while (i + 8 <= in.size() && (std::memcpy(&x, in.data() + i, 8), (x & 0x8080808080808080ULL) == 0)) {
+                    std::memcpy(p, &x, 8);
+                    p += 8;
+                    i += 8;
+                }
+                if (i == in.size()) break;
+            }
+            // Latin-1 bytes are the code points U+0000 to U+00FF.
+            appendUtf8(p, static_cast<unsigned char>(in[i++]));
+        }
+    }
+
+    void utf16(std::string_view in, char*& p) {
+        bool little = encoding == SourceEncoding::Utf16LE;
+        size_t i = 0;
+        if (hasOddByte && !in.empty()) {
+            unsigned char second = static_cast<unsigned char>(in[0]);
+            unit(little ? oddByte | (second << 8) : (oddByte << 8) | second, p);
+            hasOddByte = false;
+            i = 1;
+        }
+        while (i + 2 <= in.size()) {
+            if constexpr (std::endian::native == std::endian::little) {
+                // 4 ASCII units in a row: every high byte is 0 and every low byte < 0x80.
+                uint64_t mask = little ? 0xFF80FF80FF80FF80ULL : 0x80FF80FF80FF80FFULL;
+                uint64_t x;
+                while (!highSurrogate && i + 8 <= in.size() && (std::memcpy(&x, in.data() + i, 8), (x & mask) == 0)) {
+                    if (!little) x >>= 8;
+                    uint32_t packed = static_cast<uint32_t>((x & 0xFF) | ((x >> 8) & 0xFF00)
+                        | ((x >> 16) & 0xFF0000) | ((x >> 24) & 0xFF000000));
+                    std::memcpy(p, &packed, 4);
+                    p += 4;
+                    i += 8;
+                }
+                if (i + 2 > in.size()) break;
+            }
+            unsigned char a = static_cast<unsigned char>(in[i]), b = static_cast<unsigned char>(in[i + 1]);
+            unit(little ? a | (b << 8) : (a << 8) | b, p);
+            i += 2;
+        }
+        if (i < in.size()) {
+            oddByte = static_cast<unsigned char>(in[i]);
+            hasOddByte = true;
+        }
+    }
+
+    // One UTF-16 code unit: surrogate pairs are joined, lone surrogates become U+FFFD.
+    void unit(uint32_t u, char*& p) {
+        if (highSurrogate) {
+            if (u >= 0xDC00 && u <= 0xDFFF) {
+                appendUtf8(p, 0x10000 + ((highSurrogate - 0xD800) << 10) + (u - 0xDC00));
+                highSurrogate = 0;
+                return;
+            }
+            appendUtf8(p, 0xFFFD);
+            highSurrogate = 0;
         }
-        std::cout << "[" << t.line << ":" << t.column << "] " << type << " '" << t.lexeme << "'\n";
+        if (u >= 0xD800 && u <= 0xDBFF) highSurrogate = u;
+        else if (u >= 0xDC00 && u <= 0xDFFF) appendUtf8(p, 0xFFFD);
+        else appendUtf8(p, u);
     }
 };
 
+// Reads a source file as UTF-8 text for the lexer. The encoding comes from the byte order
+// mark, without one it is fallback. The mark itself is dropped. UTF-8 is read in one go
+// straight into the result. Other encodings are read in 64 KB blocks that are converted right
+// into the result, so there is never a second copy of the whole file, and a small file is
+// just one block. The size of a pipe (/dev/stdin) is not known, then UTF-8 is read in blocks
+// too, until the end. Errors while reading are thrown like a file that can not be opened.
+std::string readSource(const std::string& path, SourceEncoding fallback = SourceEncoding::Utf8) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open file " + path);
+    in.seekg(0, std::ios::end);
+    std::streamoff end = in.tellg();
+    size_t size = end > 0 ? static_cast<size_t>(end) : 0;
+    if (end >= 0) in.seekg(0, std::ios::beg);
+    else in.clear();   // a pipe can not seek, but nothing was read yet
+    // The mark is read first and not seeked over, so a pipe works the same way.
+    char head[3] = {};
+    in.read(head, sizeof head);
+    size_t headSize = static_cast<size_t>(in.gcount());
+    size_t bomLength;
+    SourceEncoding encoding = detectEncoding(std::string_view(head, headSize), fallback, bomLength);
+    std::string_view afterMark(head + bomLength, headSize - bomLength);
+
+    std::string data;
+    std::vector<char> block(64 * 1024);
+    auto readBlocks = [&](auto use) {
+        while (in) {
+            in.read(block.data(), static_cast<std::streamsize>(block.size()));
+            use(std::string_view(block.data(), static_cast<size_t>(in.gcount())));
+        }
+        if (in.bad()) throw std::runtime_error("Cannot read file " + path);
+    };
+    if (encoding == SourceEncoding::Utf8) {
+        data = afterMark;
+        if (size > headSize && in) {
+            data.resize(afterMark.size() + size - headSize);
+            in.read(data.data() + afterMark.size(), static_cast<std::streamsize>(size - headSize));
+            data.resize(afterMark.size() + static_cast<size_t>(in.gcount()));
+        }
+        readBlocks([&](std::string_view part) { data.append(part); });
+        return data;
+    }
+    // ASCII text gets 1/2 of the size from UTF-16 and the same size from Latin-1.
+    data.reserve(encoding == SourceEncoding::Latin1 ? size + size / 8 : size / 2 + size / 16);
+    Utf8Transcoder transcoder(encoding);
+    transcoder.feed(afterMark, data);
+    readBlocks([&](std::string_view part) { transcoder.feed(part, data); });
+    transcoder.finish(data);
+    return data;
+}
+
+// Command line mode for big inputs, so files do not have to be pasted into the console:
+//   JSLexer --dump [--async] file...         print the tokens of every file
+//   JSLexer --write-bin out.jstk [--pool] file   save the tokens of a file in binary form
+//   JSLexer --read-bin file.jstk             print the tokens stored in a binary file
+//   JSLexer --json file...                   one JSON object with all tokens per file and line
+//   JSLexer --ndjson file...                 one JSON object per token and line
+// --async lets a background thread do the writing while the lexer goes on.
+// --pool stores the source text in the binary file, so lexemes can be read back.
+// --cache DIR [--cache-size MB] takes tokens from a TokenCache in DIR for --dump, --json,
+// --ndjson and --write-bin, and only lexes files that are not in the cache yet.
+// --columns bytes|utf16|codepoints|display [--tab-width N] sets the column unit of --dump,
+// --json and --ndjson (see ColumnUnit), the default is bytes.
+// --encoding utf8|utf16le|utf16be|latin1 is the encoding of files without a byte order mark,
+// the default is utf8 (see readSource).
+int runCommandLine(int argc, char** argv) {
+    std::vector<std::string> files;
+    std::string mode, binPath, cacheDir;
+    ColumnUnit columnUnit = ColumnUnit::Bytes;
+    int tabWidth = 8;
+    SourceEncoding encoding = SourceEncoding::Utf8;
+    uint64_t cacheMegabytes = 1024;
+    bool async = false, pool = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--dump" || arg == "--read-bin" || arg == "--json" || arg == "--ndjson") mode = arg;
+        else if (arg == "--write-bin" && i + 1 < argc) { mode = arg; binPath = argv[++i]; }
+        else if (arg == "--async") async = true;
+        else if (arg == "--pool") pool = true;
+        else if (arg == "--cache" && i + 1 < argc) cacheDir = argv[++i];
+        else if (arg == "--cache-size" && i + 1 < argc) cacheMegabytes = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--encoding" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "utf8") encoding = SourceEncoding::Utf8;
+            else if (name == "utf16le") encoding = SourceEncoding::Utf16LE;
+            else if (name == "utf16be") encoding = SourceEncoding::Utf16BE;
+            else if (name == "latin1") encoding = SourceEncoding::Latin1;
+            else {
+                std::cerr << "[ERROR] Unknown encoding " << name << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "--tab-width" && i + 1 < argc) {
+            std::string width = argv[++i];
+            auto [end, ec] = std::from_chars(width.data(), width.data() + width.size(), tabWidth);
+            if (ec != std::errc() || end != width.data() + width.size() || tabWidth < 1) {
+                std::cerr << "[ERROR] Bad tab width " << width << ", it must be a number of at least 1\n";
+                return 2;
+            }
+        }
+        else if (arg == "--columns" && i + 1 < argc) {
+            std::string unit = argv[++i];
+            if (unit == "bytes") columnUnit = ColumnUnit::Bytes;
+            else if (unit == "utf16") columnUnit = ColumnUnit::Utf16;
+            else if (unit == "codepoints") columnUnit = ColumnUnit::CodePoints;
+            else if (unit == "display") columnUnit = ColumnUnit::Display;
+            else {
+                std::cerr << "[ERROR] Unknown column unit " << unit << "\n";
+                return 2;
+            }
+        }
+        else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "[ERROR] Unknown option " << arg << "\n";
+            return 2;
+        }
+        else files.push_back(arg);
+    }
+    bool manyFiles = mode == "--dump" || mode == "--json" || mode == "--ndjson";
+    if (mode.empty() || files.empty() || (!manyFiles && files.size() != 1)) {
+        std::cerr << "Usage: JSLexer --dump [--async] file...\n"
+                  << "       JSLexer --json|--ndjson [--async] file...\n"
+                  << "       JSLexer --write-bin out.jstk [--pool] file\n"
+                  << "       JSLexer --read-bin file.jstk\n"
+                  << "Options: --async, --cache DIR, --cache-size MB,\n"
+                  << "         --columns bytes|utf16|codepoints|display, --tab-width N,\n"
+                  << "         --encoding utf8|utf16le|utf16be|latin1\n";
+        return 2;
+    }
+    std::optional<TokenCache> cache;
+    if (!cacheDir.empty()) cache.emplace(cacheDir, cacheMegabytes << 20);
+    int status = 0;
+    TokenWriter out(1, async);
+    JsonTokenWriter json(out, mode == "--ndjson");
+    for (const std::string& file : files) {
+        if (mode == "--json" || mode == "--ndjson") {
+            // JSON keeps going after an error, the error is part of the output.
+            json.beginFile(file);
+            try {
+                std::string code = readSource(file, encoding);
+                ColumnMapper columns(code, columnUnit, tabWidth);
+                if (cache) {
+                    TokenFileView view = cache->get(code);
+                    for (const TokenRecord& r : view)
+                        json.write(recordType(r), static_cast<int>(r.line),
+                                   columns.column(r.offset, static_cast<int>(r.column)),
+                                   r.offset, std::string_view(code).substr(r.offset, r.length));
+                } else {
+                    JsonLexer(code, JsonObserver{ &json, columnUnit == ColumnUnit::Bytes ? nullptr : &columns }).tokenize();
+                }
+                json.endFile();
+            } catch (const std::runtime_error& err) {
+                json.endFile(err.what());
+                status = 1;
+            }
+            continue;
+        }
+        try {
+            if (mode == "--dump") {
+                std::string code = readSource(file, encoding);
+                ColumnMapper columns(code, columnUnit, tabWidth);
+                if (cache) {
+                    TokenFileView view = cache->get(code);
+                    for (const TokenRecord& r : view)
+                        out.write(recordType(r), static_cast<int>(r.line),
+                                  columns.column(r.offset, static_cast<int>(r.column)),
+                                  std::string_view(code).substr(r.offset, r.length));
+                } else {
+                    TraceLexer(code, TraceObserver{ &out, columnUnit == ColumnUnit::Bytes ? nullptr : &columns }).tokenize();
+                }
+            } else if (mode == "--write-bin") {
+                std::string code = readSource(file, encoding);
+                std::string_view poolText = pool ? std::string_view(code) : std::string_view();
+                if (cache) {
+                    writeTokenFile(binPath, cache->tokenize(code), poolText);
+                } else {
+                    // Big files have millions of tokens, TokenChunks keeps them without regrowing.
+                    TokenChunks tokens;
+                    Lexer(code).tokenize(tokens);
+                    writeTokenFile(binPath, tokens, poolText);
+                }
+            } else {
+                TokenFileView view(file);
+                for (size_t i = 0; i < view.size(); ++i)
+                    out.write(view.type(i), static_cast<int>(view[i].line), static_cast<int>(view[i].column), view.lexeme(i));
+            }
+        } catch (const std::runtime_error& err) {
+            out.flush();
+            std::cerr << "[ERROR] " << file << ": " << err.what() << "\n";
+            status = 1;
+        }
+    }
+    out.flush();
+    return status;
+}
+
 // In main(), I run an infinite loop so the user can input code multiple times.
 // Options: manual input, trace mode input, demo code, or exit.
 // If demo is chosen, console will show hardcoded piece of code 
 // On exception, user get print the error message and return to the mode selection.
+// If there are command line arguments, main runs runCommandLine instead.
 
-int main() {
+int main(int argc, char** argv) {
+if (argc > 1) return runCommandLine(argc, argv);
 while (true) {
         std::string code, mode;
         bool trace = false;
@@ -741,11 +3634,15 @@ while (true) {
             std::cout << "Invalid option. Please choose 1–4.\n";
             continue;
         }
+    // Tokens printed before an error are flushed too, so the user sees where lexing stopped.
+    TokenWriter out;
     try {
-        std::cout << "\n--- Source Code ---\n" << code << "\n";
-        Lexer lexer(code);
-        std::vector<Token> tokens = lexer.tokenize(trace);
+        std::cout << "\n--- Source Code ---\n" << code << "\n" << std::flush;
+        // Trace mode uses its own lexer type, so the normal lexer stays free of printing code.
+        std::vector<Token> tokens = trace ? TraceLexer(code, TraceObserver{ &out }).tokenize() : Lexer(code).tokenize();
+        out.flush();
     } catch (const std::runtime_error& err) {
+            out.flush();
             std::cerr << "[ERROR] " << err.what() << "\n";
         } catch (...) {
             std::cerr << "[ERROR] Unknown lexer failure.\n";